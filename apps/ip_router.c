@@ -0,0 +1,98 @@
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include "arp.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "net.h"
+#include "raw.h"
+
+#define ROUTER_NETDEV_MAX 8
+
+static int setup(void) {
+  if (ethernet_init() == -1) {
+    fprintf(stderr, "ethernet_init(): failure\n");
+    return -1;
+  } else if (ip_init() == -1) {
+    fprintf(stderr, "ip_init(): failure\n");
+    return -1;
+  } else if (arp_init() == -1) {
+    fprintf(stderr, "arp_init(): failure\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char const *argv[]) {
+  sigset_t sigset;
+  int signo;
+  struct netdev *devs[ROUTER_NETDEV_MAX];
+  struct ip_forward_stats stats;
+  int i, n;
+
+  if (argc < 4 || (argc - 1) % 3 != 0 ||
+      (argc - 1) / 3 > ROUTER_NETDEV_MAX) {
+    fprintf(stderr,
+            "usage: %s <dev> <addr> <netmask> [<dev> <addr> <netmask> ...]\n",
+            argv[0]);
+    return -1;
+  }
+
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGINT);
+  sigprocmask(SIG_BLOCK, &sigset, NULL);
+  if (setup() == -1) {
+    return -1;
+  }
+
+  // setup
+  n = (argc - 1) / 3;
+  for (i = 0; i < n; i++) {
+    devs[i] = netdev_alloc(NETDEV_TYPE_ETHERNET);
+    if (!devs[i]) {
+      fprintf(stderr, "netdev_alloc() : failed\n");
+      return -1;
+    }
+    strncpy(devs[i]->name, argv[1 + i * 3], sizeof(devs[i]->name) - 1);
+    if (devs[i]->ops->open(devs[i], RAWDEV_TYPE_AUTO) == -1) {
+      fprintf(stderr, "failed to open raw device\n");
+      return -1;
+    }
+    if (!ip_netif_register(devs[i], argv[2 + i * 3], argv[3 + i * 3], NULL)) {
+      fprintf(stderr, "ip_netif_register: failed\n");
+      return -1;
+    }
+  }
+
+  ip_set_forwarding(1);
+  for (i = 0; i < n; i++) {
+    devs[i]->ops->run(devs[i]);
+  }
+
+  fprintf(stderr, "forwarding between %d devices\n", n);
+
+  while (1) {
+    sigwait(&sigset, &signo);
+    if (signo == SIGINT) {
+      break;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    if (devs[i]->ops->close) {
+      devs[i]->ops->close(devs[i]);
+    }
+  }
+  ip_get_forward_stats(&stats);
+  fprintf(stderr,
+          "forwarded %" PRIu64 " (fragmented %" PRIu64 ", redirected %" PRIu64
+          "), dropped: ttl %" PRIu64 ", no route %" PRIu64
+          ", frag needed %" PRIu64 ", not forwardable %" PRIu64
+          ", tx %" PRIu64 "\n",
+          stats.forwarded, stats.fragmented, stats.redirected,
+          stats.ttl_exceeded, stats.no_route, stats.frag_needed,
+          stats.not_forwardable, stats.tx_errors);
+  fprintf(stderr, "closed\n");
+  return 0;
+}
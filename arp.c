@@ -4,11 +4,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 #include <time.h>
 #include "ethernet.h"
 #include "ip.h"
 #include "net.h"
+#include "timer.h"
 #include "util.h"
 
 #define ARP_HRD_ETHERNET 0x0001
@@ -16,8 +16,29 @@
 #define ARP_OP_REQUEST 1
 #define ARP_OP_REPLY 2
 
-#define ARP_TABLE_SIZE 4096
+#define ARP_TABLE_BITS 16
+#define ARP_TABLE_SIZE (1 << ARP_TABLE_BITS) /* power of two */
+#define ARP_TABLE_MASK (ARP_TABLE_SIZE - 1)
+#define ARP_TABLE_ENTRY_MAX (ARP_TABLE_SIZE / 4 * 3)
+#define ARP_TABLE_LEARNED_MAX (ARP_TABLE_ENTRY_MAX / 2)
 #define ARP_TABLE_TIMEOUT_SEC 300
+#define ARP_TABLE_REFRESH_SEC 30 /* probe entries in use before expiry */
+#define ARP_TABLE_CHECK_SEC 10   /* reference check interval near expiry */
+#define ARP_TABLE_DELETED_MAX (ARP_TABLE_SIZE / 8) /* tombstones to compact */
+#define ARP_TABLE_COMPACT_SLOTS 1024 /* slots walked per compaction step */
+#define ARP_TABLE_COMPACT_HOLES 64   /* tombstones filled per cluster walk */
+#define ARP_TABLE_COMPACT_USEC 1000
+#define ARP_LEARN_SOURCE_BITS 8
+#define ARP_LEARN_SOURCE_NUM (1 << ARP_LEARN_SOURCE_BITS) /* senders tracked */
+#define ARP_LEARN_RATE_MAX 10 /* learned entries per second per sender */
+
+#define ARP_PENDING_QUEUE_MAX 64 /* packets queued per unresolved entry */
+#define ARP_REQUEST_INTERVAL_MSEC 1000
+#define ARP_REQUEST_RETRY_MAX 3
+
+#define ARP_ENTRY_STATE_FREE 0
+#define ARP_ENTRY_STATE_USED 1
+#define ARP_ENTRY_STATE_DELETED 2 /* tombstone for open addressing */
 
 struct arp_hdr {
   uint16_t hrd;
@@ -36,20 +57,41 @@ struct arp_ethernet {
 } __attribute__((packed));
 
 struct arp_entry {
-  unsigned char used;
+  unsigned int seq;  // sequence lock. odd while the entry is being updated
+  unsigned char state;
+  struct netif *netif;
   ip_addr_t pa;
   uint8_t ha[ETHERNET_ADDR_LEN];
   time_t timestamp;
-  pthread_cond_t cond;
-  void *data;
-  size_t len;
-  struct netif *netif;
+  unsigned char referenced;  // CLOCK reference bit. set by lock free lookup
+  unsigned char learned;     // inserted from received message
+  struct timer timer;  // request retry while resolving, aging after that
+  // followings are used while resolving and protected by mutex
+  struct queue_head pending;
+  unsigned char retry;
 };
 
+// open addressing hash table keyed by (netif, pa).
+// writers serialize on mutex, readers don't take any lock.
 static struct arp_entry arp_table[ARP_TABLE_SIZE];
-static time_t timestamp;
+static size_t arp_table_num = 0;
+static size_t arp_table_learned = 0;
+static size_t arp_table_deleted = 0;
+static uint32_t clock_hand = 0;
+static uint32_t compact_hand = 0;
+static struct timer compact_timer;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// entries learned in the current second, per sender hardware address.
+// direct mapped, so colliding senders just take over the slot
+struct arp_learn_source {
+  uint8_t ha[ETHERNET_ADDR_LEN];
+  time_t timestamp;
+  int count;
+};
+
+static struct arp_learn_source learn_sources[ARP_LEARN_SOURCE_NUM];
+
 static char *arp_opcode_ntop(uint16_t opcode) {
   switch (ntoh16(opcode)) {
     case ARP_OP_REQUEST:
@@ -86,97 +128,459 @@ static void arp_dump(uint8_t *packet, size_t plen) {
  * CONTROL ARP TABLE ENTRY
  */
 
-static struct arp_entry *arp_table_freespace(void) {
+static uint32_t arp_table_hash(const struct netif *netif, ip_addr_t pa) {
+  uint32_t key;
+
+  key = pa ^ (uint32_t)((uintptr_t)netif >> 4);
+  // multiplicative hashing (golden ratio)
+  return (key * 0x9e3779b1) >> (32 - ARP_TABLE_BITS);
+}
+
+static unsigned int arp_entry_read_begin(const struct arp_entry *entry) {
+  unsigned int seq;
+
+  // wait while a writer is updating this entry
+  while ((seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE)) & 1) {
+  }
+  return seq;
+}
+
+static int arp_entry_read_retry(const struct arp_entry *entry,
+                                unsigned int seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void arp_entry_write_begin(struct arp_entry *entry) {
+  __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void arp_entry_write_end(struct arp_entry *entry) {
+  __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+}
+
+// lock free lookup. returns 1 and copies hardware address if resolved entry is
+// found, otherwise returns 0.
+static int arp_table_lookup(const struct netif *netif, const ip_addr_t *pa,
+                            uint8_t *ha) {
   struct arp_entry *entry;
-  int i;
+  uint32_t idx;
+  unsigned int seq;
+  unsigned char state;
+  int match, n;
+
+  idx = arp_table_hash(netif, *pa);
+  for (n = 0; n < ARP_TABLE_SIZE; n++) {
+    entry = &arp_table[idx];
+    do {
+      seq = arp_entry_read_begin(entry);
+      state = entry->state;
+      match = state == ARP_ENTRY_STATE_USED && entry->netif == netif &&
+              entry->pa == *pa;
+      if (match) {
+        memcpy(ha, entry->ha, ETHERNET_ADDR_LEN);
+      }
+    } while (arp_entry_read_retry(entry, seq));
+    if (state == ARP_ENTRY_STATE_FREE) {
+      // end of probe sequence
+      return 0;
+    }
+    if (match) {
+      if (memcmp(ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+        return 0;
+      }
+      // avoid writing the shared cache line when the bit is already set
+      if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+      }
+      return 1;
+    }
+    idx = (idx + 1) & ARP_TABLE_MASK;
+  }
+  return 0;
+}
 
-  for (i = 0; i < ARP_TABLE_SIZE; i++) {
-    entry = &arp_table[i];
-    if (!entry->used) {
+// must be called with mutex
+static struct arp_entry *arp_table_select(const struct netif *netif,
+                                          const ip_addr_t *pa) {
+  struct arp_entry *entry;
+  uint32_t idx;
+  int n;
+
+  idx = arp_table_hash(netif, *pa);
+  for (n = 0; n < ARP_TABLE_SIZE; n++) {
+    entry = &arp_table[idx];
+    if (entry->state == ARP_ENTRY_STATE_FREE) {
+      return NULL;
+    }
+    if (entry->state == ARP_ENTRY_STATE_USED && entry->netif == netif &&
+        entry->pa == *pa) {
       return entry;
     }
+    idx = (idx + 1) & ARP_TABLE_MASK;
   }
-  // TODO: remove unused entry with LRU
   return NULL;
 }
 
-static int arp_table_insert(const ip_addr_t *pa, const uint8_t *ha) {
+static void arp_entry_clear(struct arp_entry *entry);
+
+// must be called with mutex. remove a resolved entry that is not referenced
+// since the clock hand passed last time. if learned_only is set, entries
+// inserted by arp_resolve are kept.
+static int arp_table_evict(int learned_only) {
   struct arp_entry *entry;
+  int n;
+
+  for (n = 0; n < ARP_TABLE_SIZE * 2; n++) {
+    entry = &arp_table[clock_hand];
+    clock_hand = (clock_hand + 1) & ARP_TABLE_MASK;
+    if (entry->state != ARP_ENTRY_STATE_USED ||
+        memcmp(entry->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+      // unused or resolving
+      continue;
+    }
+    if (learned_only && !entry->learned) {
+      continue;
+    }
+    if (__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+      // second chance
+      __atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+      if (entry->learned) {
+        // entry in use is not replaced by learned entries any more
+        entry->learned = 0;
+        arp_table_learned--;
+      }
+      continue;
+    }
+    arp_entry_clear(entry);
+    return 0;
+  }
+  return -1;
+}
 
-  entry = arp_table_freespace();
-  if (!entry) {
-    return -1;
+// must be called with mutex. returns a slot for the key, or NULL if the key
+// is in table already. the probe sequence is followed to its end, since the
+// key may be beyond the first reusable slot.
+static struct arp_entry *arp_table_freespace(const struct netif *netif,
+                                             const ip_addr_t *pa,
+                                             int learned) {
+  struct arp_entry *entry, *slot = NULL;
+  uint32_t idx;
+  int n;
+
+  if (arp_table_num >= ARP_TABLE_ENTRY_MAX && arp_table_evict(learned) == -1) {
+    return NULL;
+  }
+  idx = arp_table_hash(netif, *pa);
+  for (n = 0; n < ARP_TABLE_SIZE; n++) {
+    entry = &arp_table[idx];
+    if (entry->state == ARP_ENTRY_STATE_FREE) {
+      return slot ? slot : entry;
+    }
+    if (entry->state == ARP_ENTRY_STATE_USED) {
+      if (entry->netif == netif && entry->pa == *pa) {
+        return NULL;
+      }
+    } else if (!slot) {
+      slot = entry;
+    }
+    idx = (idx + 1) & ARP_TABLE_MASK;
+  }
+  return slot;
+}
+
+static void arp_entry_timeout(void *arg);
+
+// the first reference check is ARP_TABLE_CHECK_SEC before the refresh window
+static void arp_entry_age(struct arp_entry *entry, time_t age) {
+  time_t wait;
+
+  wait = ARP_TABLE_TIMEOUT_SEC - ARP_TABLE_REFRESH_SEC - ARP_TABLE_CHECK_SEC -
+         age;
+  timer_add(&entry->timer, (uint64_t)MAX(wait, 0) * 1000000);
+}
+
+// must be called with mutex
+static void arp_entry_set(struct arp_entry *entry, struct netif *netif,
+                          const ip_addr_t *pa, const uint8_t *ha,
+                          int learned) {
+  if (entry->state == ARP_ENTRY_STATE_DELETED) {
+    arp_table_deleted--;
   }
-  entry->used = 1;
+  arp_entry_write_begin(entry);
+  entry->state = ARP_ENTRY_STATE_USED;
+  entry->netif = netif;
   entry->pa = *pa;
   memcpy(entry->ha, ha, ETHERNET_ADDR_LEN);
   time(&entry->timestamp);
-  pthread_cond_broadcast(&entry->cond);
+  arp_entry_write_end(entry);
+  __atomic_store_n(&entry->referenced, learned ? 0 : 1, __ATOMIC_RELAXED);
+  entry->learned = learned;
+  arp_table_num++;
+  if (learned) {
+    arp_table_learned++;
+  }
+  timer_setup(&entry->timer, arp_entry_timeout, entry);
+  if (memcmp(ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+    entry->retry = 0;
+    timer_add(&entry->timer, (uint64_t)ARP_REQUEST_INTERVAL_MSEC * 1000);
+  } else {
+    arp_entry_age(entry, 0);
+  }
+}
+
+// must be called with mutex. counts an entry learned from the sender, and
+// returns -1 if it has reached the rate limit
+static int arp_learn_limit(const uint8_t *sha) {
+  struct arp_learn_source *src;
+  uint32_t key;
+  time_t now;
+
+  key = ((uint32_t)sha[2] << 24 | (uint32_t)sha[3] << 16 |
+         (uint32_t)sha[4] << 8 | sha[5]) ^
+        ((uint32_t)sha[0] << 8 | sha[1]);
+  src = &learn_sources[(key * 0x9e3779b1) >> (32 - ARP_LEARN_SOURCE_BITS)];
+  time(&now);
+  if (src->timestamp != now || memcmp(src->ha, sha, ETHERNET_ADDR_LEN) != 0) {
+    memcpy(src->ha, sha, ETHERNET_ADDR_LEN);
+    src->timestamp = now;
+    src->count = 0;
+  }
+  if (src->count >= ARP_LEARN_RATE_MAX) {
+    return -1;
+  }
+  src->count++;
   return 0;
 }
 
-static struct arp_entry *arp_table_select(const ip_addr_t *pa) {
+// insert entry learned from received message. each sender may insert only a
+// few entries per second. senders forging their addresses get around that,
+// so the learned entries are also limited to half of the table and can only
+// replace other learned entries. a flood of ARP messages doesn't push out
+// the peers in use.
+static int arp_table_insert(struct netif *netif, const ip_addr_t *pa,
+                            const uint8_t *ha) {
   struct arp_entry *entry;
-  int i;
 
-  for (i = 0; i < ARP_TABLE_SIZE; i++) {
-    entry = &arp_table[i];
-    if (entry->used && entry->pa == *pa) {
-      return entry;
-    }
+  if (arp_learn_limit(ha) == -1) {
+    return -1;
   }
-  return NULL;
+  if (arp_table_learned >= ARP_TABLE_LEARNED_MAX && arp_table_evict(1) == -1) {
+    return -1;
+  }
+  entry = arp_table_freespace(netif, pa, 1);
+  if (!entry) {
+    return -1;
+  }
+  arp_entry_set(entry, netif, pa, ha, 1);
+  return 0;
 }
 
-static int arp_table_update(struct netdev *dev, const ip_addr_t *pa,
-                            const uint8_t *ha) {
+static void arp_pending_clear(struct queue_head *pending) {
+  void *data;
+  size_t size;
+
+  while (queue_pop(pending, &data, &size) != -1) {
+    free(data);
+  }
+}
+
+// queued packets are moved to pending and should be sent by the caller after
+// releasing mutex
+static int arp_table_update(struct netif *netif, const ip_addr_t *pa,
+                            const uint8_t *ha, struct queue_head *pending) {
   struct arp_entry *entry;
 
   // find entry
-  entry = arp_table_select(pa);
+  entry = arp_table_select(netif, pa);
   if (!entry) {
     return -1;
   }
 
+  if (memcmp(entry->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+    // resolving is completed
+    *pending = entry->pending;
+    memset(&entry->pending, 0, sizeof(entry->pending));
+    entry->retry = 0;
+    arp_entry_age(entry, 0);
+  }
+
   // set resolved
+  arp_entry_write_begin(entry);
   memcpy(entry->ha, ha, ETHERNET_ADDR_LEN);
   time(&entry->timestamp);
+  arp_entry_write_end(entry);
+  return 0;
+}
+
+// must be called with mutex. tombstones followed by a free slot end no probe
+// sequence, so they can be freed without disturbing concurrent readers. idx is
+// the slot just before the free one.
+static void arp_table_trim(uint32_t idx) {
+  while (arp_table[idx].state == ARP_ENTRY_STATE_DELETED) {
+    arp_entry_write_begin(&arp_table[idx]);
+    arp_table[idx].state = ARP_ENTRY_STATE_FREE;
+    arp_entry_write_end(&arp_table[idx]);
+    arp_table_deleted--;
+    idx = (idx - 1) & ARP_TABLE_MASK;
+  }
+}
 
-  // send saved packet data with resolved hardware address
-  if (entry->data) {
-    if (entry->netif->dev != dev) {
-      fprintf(stderr, "[warning] receive response from unintended device\n");
-      dev = entry->netif->dev;
+// must be called with mutex. move entry back to a tombstone earlier in its
+// probe sequence, which leaves a tombstone at the old slot. lock free lookup
+// passing by meanwhile may miss the entry and falls back to arp_resolve, which
+// waits for mutex.
+static void arp_entry_move(struct arp_entry *dst, struct arp_entry *src) {
+  time_t now;
+
+  timer_del(&src->timer);
+  arp_entry_write_begin(dst);
+  dst->state = ARP_ENTRY_STATE_USED;
+  dst->netif = src->netif;
+  dst->pa = src->pa;
+  memcpy(dst->ha, src->ha, ETHERNET_ADDR_LEN);
+  dst->timestamp = src->timestamp;
+  arp_entry_write_end(dst);
+  dst->referenced = src->referenced;
+  dst->learned = src->learned;
+  // queued packets move with the entry
+  dst->pending = src->pending;
+  memset(&src->pending, 0, sizeof(src->pending));
+  dst->retry = src->retry;
+  arp_entry_write_begin(src);
+  src->state = ARP_ENTRY_STATE_DELETED;
+  src->pa = 0;
+  memset(src->ha, 0, ETHERNET_ADDR_LEN);
+  src->timestamp = 0;
+  src->netif = NULL;
+  arp_entry_write_end(src);
+  src->learned = 0;
+  src->retry = 0;
+  // a timer of the old slot being dispatched finds the slot deleted, or taken
+  // by another entry whose timer is pending, and does nothing
+  timer_setup(&dst->timer, arp_entry_timeout, dst);
+  if (memcmp(dst->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+    timer_add(&dst->timer, (uint64_t)ARP_REQUEST_INTERVAL_MSEC * 1000);
+  } else {
+    time(&now);
+    arp_entry_age(dst, now - dst->timestamp);
+  }
+}
+
+// must be called with mutex. walk the cluster from the tombstone at idx to
+// its end, moving each entry back to the earliest tombstone its probe
+// sequence passes. no entry left in the cluster passes the tombstones
+// collected on the way, so they end no probe sequence and are freed.
+// returns the free slot at the end of the cluster.
+static uint32_t arp_table_compact_cluster(uint32_t idx, int *walked) {
+  struct arp_entry *entry;
+  uint32_t holes[ARP_TABLE_COMPACT_HOLES], home;
+  int num = 0, n, i;
+
+  for (n = 0; (entry = &arp_table[idx])->state != ARP_ENTRY_STATE_FREE;
+       idx = (idx + 1) & ARP_TABLE_MASK, n++) {
+    if (n == ARP_TABLE_SIZE) {
+      // no free slot. the table is full of tombstones, which are kept
+      *walked += n;
+      return idx;
     }
-    dev->ops->tx(dev, ETHERNET_TYPE_IP, (uint8_t *)entry->data, entry->len,
-                 entry->ha);
-    free(entry->data);
-    entry->data = NULL;
-    entry->len = 0;
+    if (entry->state == ARP_ENTRY_STATE_USED) {
+      home = arp_table_hash(entry->netif, entry->pa);
+      for (i = 0; i < num; i++) {
+        if (((holes[i] - home) & ARP_TABLE_MASK) <
+            ((idx - home) & ARP_TABLE_MASK)) {
+          break;
+        }
+      }
+      if (i == num) {
+        continue;
+      }
+      arp_entry_move(&arp_table[holes[i]], entry);
+      memmove(&holes[i], &holes[i + 1], sizeof(holes[0]) * (num - i - 1));
+      num--;
+    }
+    // tombstones beyond the capacity are kept, which is always safe
+    if (num < ARP_TABLE_COMPACT_HOLES) {
+      holes[num++] = idx;
+    }
+  }
+  *walked += n;
+  for (i = 0; i < num; i++) {
+    entry = &arp_table[holes[i]];
+    arp_entry_write_begin(entry);
+    entry->state = ARP_ENTRY_STATE_FREE;
+    arp_entry_write_end(entry);
+    arp_table_deleted--;
   }
+  return idx;
+}
 
-  pthread_cond_broadcast(&entry->cond);
-  return 0;
+// runs on the timer thread. tombstones lengthen probe sequences of misses, so
+// they are cleaned up a part of the table at a time, and mutex is released
+// in between. the tx path never waits for a full table rebuild.
+static void arp_table_compact(void *arg) {
+  int n = 0;
+
+  pthread_mutex_lock(&mutex);
+  if (timer_pending(&compact_timer)) {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  while (n < ARP_TABLE_COMPACT_SLOTS && arp_table_deleted > 0) {
+    if (arp_table[compact_hand].state == ARP_ENTRY_STATE_DELETED) {
+      compact_hand = arp_table_compact_cluster(compact_hand, &n);
+    }
+    compact_hand = (compact_hand + 1) & ARP_TABLE_MASK;
+    n++;
+  }
+  if (arp_table_deleted > 0) {
+    timer_add(&compact_timer, ARP_TABLE_COMPACT_USEC);
+  }
+  pthread_mutex_unlock(&mutex);
 }
 
 static void arp_entry_clear(struct arp_entry *entry) {
-  entry->used = 0;
+  uint32_t idx;
+
+  timer_del(&entry->timer);
+  if (memcmp(entry->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+    // give up resolving
+    arp_pending_clear(&entry->pending);
+    entry->retry = 0;
+  }
+  arp_entry_write_begin(entry);
+  entry->state = ARP_ENTRY_STATE_DELETED;
   entry->pa = 0;
   memset(entry->ha, 0, ETHERNET_ADDR_LEN);
   entry->timestamp = 0;
-  if (entry->data) {
-    free(entry->data);
-    entry->data = NULL;
-    entry->len = 0;
-  }
   entry->netif = NULL;
+  arp_entry_write_end(entry);
+  arp_table_num--;
+  arp_table_deleted++;
+  if (entry->learned) {
+    entry->learned = 0;
+    arp_table_learned--;
+  }
+
+  idx = array_offset(arp_table, entry);
+  if (arp_table[(idx + 1) & ARP_TABLE_MASK].state == ARP_ENTRY_STATE_FREE) {
+    arp_table_trim(idx);
+  }
+  // the rest are cleaned up on the timer thread
+  if (arp_table_deleted >= ARP_TABLE_DELETED_MAX &&
+      !timer_pending(&compact_timer)) {
+    timer_add(&compact_timer, 0);
+  }
 }
 
 /*
  * ARP COMMUNICATION
  */
 
-static int arp_send_request(struct netif *netif, const ip_addr_t *tpa) {
+// dst is NULL for broadcast
+static int arp_send_request(struct netif *netif, const ip_addr_t *tpa,
+                            const uint8_t *dst) {
   struct arp_ethernet request;
 
   if (!tpa) {
@@ -199,7 +603,8 @@ static int arp_send_request(struct netif *netif, const ip_addr_t *tpa) {
 #endif
 
   if (netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&request,
-                          sizeof(request), ETHERNET_ADDR_BROADCAST) == -1) {
+                          sizeof(request),
+                          dst ? dst : ETHERNET_ADDR_BROADCAST) == -1) {
     return -1;
   }
   return 0;
@@ -238,24 +643,79 @@ static int arp_send_reply(struct netif *netif, const uint8_t *tha,
  * ARP INTERFACES
  */
 
-static void arp_table_patrol(void) {
+// runs on the timer thread. entries expire ARP_TABLE_TIMEOUT_SEC after last
+// update, and the ones in use are refreshed by unicast request before that,
+// so that the peer in use never waits for resolving.
+static void arp_entry_timeout(void *arg) {
   struct arp_entry *entry;
-  int i;
+  time_t age;
 
-  for (i = 0; i < ARP_TABLE_SIZE; i++) {
-    entry = &arp_table[i];
-    if (entry->used && timestamp - entry->timestamp > ARP_TABLE_TIMEOUT_SEC) {
+  entry = (struct arp_entry *)arg;
+  pthread_mutex_lock(&mutex);
+  if (entry->state != ARP_ENTRY_STATE_USED || timer_pending(&entry->timer)) {
+    // cleared or re-armed while this timer was being dispatched
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  if (memcmp(entry->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
+    if (entry->retry >= ARP_REQUEST_RETRY_MAX) {
+      // no reply. drop queued packets
       arp_entry_clear(entry);
-      pthread_cond_broadcast(&entry->cond);
+    } else {
+      entry->retry++;
+      arp_send_request(entry->netif, &entry->pa, NULL);
+      timer_add(&entry->timer, (uint64_t)ARP_REQUEST_INTERVAL_MSEC * 1000);
     }
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  age = time(NULL) - entry->timestamp;
+  if (age >= ARP_TABLE_TIMEOUT_SEC) {
+    arp_entry_clear(entry);
+    pthread_mutex_unlock(&mutex);
+    return;
   }
+  if (age < ARP_TABLE_TIMEOUT_SEC - ARP_TABLE_REFRESH_SEC -
+                ARP_TABLE_CHECK_SEC) {
+    // updated by a received message since armed
+    arp_entry_age(entry, age);
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+  if (__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+    if (entry->learned) {
+      entry->learned = 0;
+      arp_table_learned--;
+    }
+    if (age >= ARP_TABLE_TIMEOUT_SEC - ARP_TABLE_REFRESH_SEC) {
+      arp_send_request(entry->netif, &entry->pa, entry->ha);
+    }
+  }
+  timer_add(&entry->timer,
+            (uint64_t)MIN(ARP_TABLE_CHECK_SEC, ARP_TABLE_TIMEOUT_SEC - age) *
+                1000000);
+  pthread_mutex_unlock(&mutex);
 }
 
-static void arp_rx(uint8_t *packet, size_t plen, struct netdev *dev) {
+static void arp_pending_flush(struct netif *netif, const uint8_t *ha,
+                              struct queue_head *pending) {
+  void *data;
+  size_t size;
+
+  while (queue_pop(pending, &data, &size) != -1) {
+    netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_IP, (uint8_t *)data, size,
+                        ha);
+    free(data);
+  }
+}
+
+static void arp_rx(uint8_t *packet, size_t plen, struct netdev *dev,
+                   uint16_t flags) {
   struct arp_ethernet *message;
-  time_t now;
-  int marge = 0;
+  int target;
   struct netif *netif;
+  ip_addr_t spa;
+  struct queue_head pending = {};
 
   // validate length
   if (plen < sizeof(struct arp_ethernet)) {
@@ -282,109 +742,112 @@ static void arp_rx(uint8_t *packet, size_t plen, struct netdev *dev) {
   arp_dump(packet, plen);
 #endif
 
-  pthread_mutex_lock(&mutex);
-  time(&now);
-  if (now - timestamp > 10) {
-    timestamp = now;
-    arp_table_patrol();
+  netif = netdev_get_netif(dev, NETIF_FAMILY_IPV4);
+  if (!netif) {
+    return;
   }
+  spa = message->spa;
+  target = ((struct netif_ip *)netif)->unicast == message->tpa;
 
-  // update arp table entry
-  marge = (arp_table_update(dev, &message->spa, message->sha) == 0) ? 1 : 0;
+  // update arp table entry, or save arp message if target is this machine.
+  // both in one hold of mutex, otherwise arp_resolve could create the entry
+  // in between
+  pthread_mutex_lock(&mutex);
+  if (arp_table_update(netif, &spa, message->sha, &pending) == -1 && target) {
+    arp_table_insert(netif, &spa, message->sha);
+  }
   pthread_mutex_unlock(&mutex);
 
-  // save arp message if target is this machine
-  netif = netdev_get_netif(dev, NETIF_FAMILY_IPV4);
-  if (netif && ((struct netif_ip *)netif)->unicast == message->tpa) {
-    if (!marge) {
-      pthread_mutex_lock(&mutex);
-      // TODO: if there is no space
-      // TODO: Resilient for DoS attack
-      arp_table_insert(&message->spa, message->sha);
-      pthread_mutex_unlock(&mutex);
-    }
+  // send queued packets with resolved hardware address
+  arp_pending_flush(netif, message->sha, &pending);
+
+  if (target) {
     if (ntoh16(message->hdr.op) == ARP_OP_REQUEST) {
-      arp_send_reply(netif, message->sha, &message->spa, message->sha);
+      arp_send_reply(netif, message->sha, &spa, message->sha);
     }
   }
   return;
 }
 
+// must be called with mutex
+static int arp_pending_push(struct arp_entry *entry, const void *data,
+                            size_t len) {
+  void *copy;
+  size_t size;
+
+  if (entry->pending.num >= ARP_PENDING_QUEUE_MAX) {
+    // drop the oldest packet
+    if (queue_pop(&entry->pending, &copy, &size) != -1) {
+      free(copy);
+    }
+  }
+  copy = malloc(len);
+  if (!copy) {
+    return -1;
+  }
+  memcpy(copy, data, len);
+  if (queue_push(&entry->pending, copy, len) == -1) {
+    free(copy);
+    return -1;
+  }
+  return 0;
+}
+
+// never blocks. if hardware address is not resolved yet, the packet is queued
+// and sent when reply arrives.
 int arp_resolve(struct netif *netif, const ip_addr_t *pa, uint8_t *ha,
                 const void *data, size_t len) {
-  struct timeval now;
-  struct timespec timeout;
   struct arp_entry *entry;
-  int ret;
-
-  pthread_mutex_lock(&mutex);
 
-  // set timeout
-  gettimeofday(&now, NULL);
-  timeout.tv_sec = now.tv_sec + 1;
-  timeout.tv_nsec = now.tv_usec * 1000;
+  // fast path. resolved entry is found without lock
+  if (arp_table_lookup(netif, pa, ha)) {
+    return ARP_RESOLVE_FOUND;
+  }
 
-  entry = arp_table_select(pa);
+  pthread_mutex_lock(&mutex);
+  entry = arp_table_select(netif, pa);
   if (entry) {
-    if (memcmp(entry->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) == 0) {
-      // apr request has already sent. wait for reply
-      // resend arp request for the case packet loss
-      arp_send_request(netif, pa);
-      do {
-        // wait until reply come with timeout
-        ret = pthread_cond_timedwait(&entry->cond, &mutex, &timeout);
-      } while (ret == EINTR);
-      if (!entry->used || ret == ETIMEDOUT) {
-        if (entry->used) {
-          arp_entry_clear(entry);
-        }
-        pthread_mutex_unlock(&mutex);
-        return ARP_RESOLVE_ERROR;
-      }
+    if (memcmp(entry->ha, ETHERNET_ADDR_ANY, ETHERNET_ADDR_LEN) != 0) {
+      // resolved after the fast path
+      memcpy(ha, entry->ha, ETHERNET_ADDR_LEN);
+      pthread_mutex_unlock(&mutex);
+      return ARP_RESOLVE_FOUND;
+    }
+    // arp request has already sent. request is resent by entry timer
+    if (data && arp_pending_push(entry, data, len) == -1) {
+      pthread_mutex_unlock(&mutex);
+      return ARP_RESOLVE_ERROR;
     }
-    memcpy(ha, entry->ha, ETHERNET_ADDR_LEN);
     pthread_mutex_unlock(&mutex);
-    return ARP_RESOLVE_FOUND;
+    return ARP_RESOLVE_QUERY;
   }
 
   // create arp table entry
-  entry = arp_table_freespace();
+  entry = arp_table_freespace(netif, pa, 0);
   if (!entry) {
     pthread_mutex_unlock(&mutex);
     return ARP_RESOLVE_ERROR;
   }
 
-  // save data
-  if (data) {
-    entry->data = malloc(len);
-    if (!entry->data) {
-      pthread_mutex_unlock(&mutex);
-      return ARP_RESOLVE_ERROR;
-    }
-    memcpy(entry->data, data, len);
-    entry->len = len;
+  // set arp entry as incomplete
+  arp_entry_set(entry, netif, pa, ETHERNET_ADDR_ANY, 0);
+  if (data && arp_pending_push(entry, data, len) == -1) {
+    arp_entry_clear(entry);
+    pthread_mutex_unlock(&mutex);
+    return ARP_RESOLVE_ERROR;
   }
-
-  // set arp entry
-  entry->used = 1;
-  entry->pa = *pa;
-  time(&entry->timestamp);
-  entry->netif = netif;
-
   // send arp query request
-  arp_send_request(netif, pa);
+  arp_send_request(netif, pa, NULL);
 
   pthread_mutex_unlock(&mutex);
   return ARP_RESOLVE_QUERY;
 }
 
 int arp_init(void) {
-  int i;
-
-  time(&timestamp);
-  for (i = 0; i < ARP_TABLE_SIZE; i++) {
-    pthread_cond_init(&arp_table[i].cond, NULL);
+  if (timer_init() == -1) {
+    return -1;
   }
+  timer_setup(&compact_timer, arp_table_compact, NULL);
   netdev_proto_register(NETDEV_PROTO_ARP, arp_rx);
   return 0;
 }
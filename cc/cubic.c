@@ -0,0 +1,104 @@
+#include <stdint.h>
+#include "tcp_cc.h"
+#include "util.h"
+
+// CUBIC congestion control
+// https://tools.ietf.org/html/rfc9438
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+// windows are in segments
+struct cubic {
+  double w_max;   // window before the last reduction
+  double k;       // time to reach w_max again (sec)
+  double origin;  // origin point of cubic function
+  double w_est;   // window of reno-friendly region
+  uint64_t epoch; // start of congestion avoidance stage, 0 if not started
+};
+
+// cube root by newton's method. it is needed once per congestion epoch
+static double cubic_cbrt(double x) {
+  double y;
+  int i;
+
+  if (x <= 0) {
+    return 0;
+  }
+  y = x > 1 ? x / 3 : 1;
+  for (i = 0; i < 64; i++) {
+    y = (2 * y + x / (y * y)) / 3;
+  }
+  return y;
+}
+
+static void cubic_init(struct tcp_cc *cc) {
+  cc->cwnd = tcp_cc_initial_window(cc->mss);
+  cc->ssthresh = UINT32_MAX;
+}
+
+static void cubic_on_ack(struct tcp_cc *cc, uint32_t acked, uint32_t rtt,
+                         uint64_t now) {
+  struct cubic *cubic = (struct cubic *)cc->priv;
+  double cwnd, t, target;
+
+  acked = tcp_cc_slow_start(cc, acked);
+  if (!acked) {
+    return;
+  }
+  cwnd = (double)cc->cwnd / cc->mss;
+  if (!cubic->epoch) {
+    cubic->epoch = now;
+    if (cwnd < cubic->w_max) {
+      cubic->k = cubic_cbrt((cubic->w_max - cwnd) / CUBIC_C);
+      cubic->origin = cubic->w_max;
+    } else {
+      cubic->k = 0;
+      cubic->origin = cwnd;
+    }
+    cubic->w_est = cwnd;
+  }
+
+  // W_cubic(t + RTT)
+  t = (double)(now - cubic->epoch + rtt) / 1000000 - cubic->k;
+  target = cubic->origin + CUBIC_C * t * t * t;
+
+  // reno-friendly region grows as standard tcp would do
+  cubic->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked /
+                  cc->mss / cwnd;
+  target = MAX(target, cubic->w_est);
+
+  target = MIN(target, 1.5 * cwnd);
+  if (target > cwnd) {
+    cc->cwnd += (uint32_t)((target - cwnd) / cwnd * acked);
+  }
+}
+
+static void cubic_on_loss(struct tcp_cc *cc, uint32_t flight, uint64_t now) {
+  struct cubic *cubic = (struct cubic *)cc->priv;
+  double cwnd;
+
+  cwnd = (double)cc->cwnd / cc->mss;
+  cubic->epoch = 0;
+  // fast convergence: release bandwidth for new flows
+  if (cwnd < cubic->w_max) {
+    cubic->w_max = cwnd * (1 + CUBIC_BETA) / 2;
+  } else {
+    cubic->w_max = cwnd;
+  }
+  cc->ssthresh = MAX((uint32_t)(cc->cwnd * CUBIC_BETA), 2 * cc->mss);
+  cc->cwnd = cc->ssthresh;
+}
+
+static void cubic_on_rto(struct tcp_cc *cc, uint32_t flight, uint64_t now) {
+  cubic_on_loss(cc, flight, now);
+  // loss window
+  cc->cwnd = cc->mss;
+}
+
+struct tcp_cc_ops tcp_cc_cubic_ops = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_rto = cubic_on_rto,
+};
@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include "tcp_cc.h"
+#include "util.h"
+
+// RFC 5681 congestion control. fast recovery of RFC 6582 is done by tcp
+// itself with cwnd and ssthresh set here.
+
+struct newreno {
+  uint32_t acked;  // bytes acked in congestion avoidance
+};
+
+static void newreno_init(struct tcp_cc *cc) {
+  cc->cwnd = tcp_cc_initial_window(cc->mss);
+  cc->ssthresh = UINT32_MAX;
+}
+
+static void newreno_on_ack(struct tcp_cc *cc, uint32_t acked, uint32_t rtt,
+                           uint64_t now) {
+  struct newreno *reno = (struct newreno *)cc->priv;
+
+  acked = tcp_cc_slow_start(cc, acked);
+  if (!acked) {
+    return;
+  }
+  // congestion avoidance: increase 1 mss per cwnd acked
+  reno->acked += acked;
+  if (reno->acked >= cc->cwnd) {
+    reno->acked -= cc->cwnd;
+    cc->cwnd += cc->mss;
+  }
+}
+
+static void newreno_on_loss(struct tcp_cc *cc, uint32_t flight,
+                            uint64_t now) {
+  struct newreno *reno = (struct newreno *)cc->priv;
+
+  cc->ssthresh = MAX(flight / 2, 2 * cc->mss);
+  cc->cwnd = cc->ssthresh;
+  reno->acked = 0;
+}
+
+static void newreno_on_rto(struct tcp_cc *cc, uint32_t flight, uint64_t now) {
+  newreno_on_loss(cc, flight, now);
+  // loss window
+  cc->cwnd = cc->mss;
+}
+
+struct tcp_cc_ops tcp_cc_newreno_ops = {
+    .name = "newreno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .on_loss = newreno_on_loss,
+    .on_rto = newreno_on_rto,
+};
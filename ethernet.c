@@ -134,6 +134,7 @@ static void ethernet_rx(uint8_t *frame, size_t flen, void *arg) {
   struct ethernet_hdr *hdr;
   uint8_t *payload;
   size_t plen;
+  uint16_t flags = 0;
 
   dev = (struct netdev *)arg;
   if (flen < sizeof(struct ethernet_hdr)) {
@@ -146,6 +147,7 @@ static void ethernet_rx(uint8_t *frame, size_t flen, void *arg) {
     if (memcmp(ETHERNET_ADDR_BROADCAST, hdr->dst, ETHERNET_ADDR_LEN) != 0) {
       return;
     }
+    flags |= NETDEV_RX_FLAG_BROADCAST;
   }
 
 #ifdef DEBUG
@@ -155,7 +157,7 @@ static void ethernet_rx(uint8_t *frame, size_t flen, void *arg) {
 
   payload = (uint8_t *)(hdr + 1);
   plen = flen - sizeof(struct ethernet_hdr);
-  dev->rx_handler(dev, hdr->type, payload, plen);
+  dev->rx_handler(dev, hdr->type, payload, plen, flags);
 }
 
 static void *ethernet_rx_thread(void *arg) {
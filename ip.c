@@ -8,11 +8,35 @@
 #include <time.h>
 #include "arp.h"
 #include "net.h"
+#include "timer.h"
 #include "util.h"
 
 #define IP_FRAGMENT_TIMEOUT_SEC 30
 #define IP_FRAGMENT_NUM_MAX 8
 
+#define IP_ROUTE_TABLE_SIZE 16
+
+#define IP_FLAG_DF 0x4000
+#define IP_FLAG_MF 0x2000
+#define IP_OFFSET_MASK 0x1fff
+
+#define IP_OPT_EOL 0
+#define IP_OPT_NOP 1
+#define IP_OPT_COPIED 0x80 /* option is copied into all fragments */
+
+#define ICMP_TYPE_DEST_UNREACH 3
+#define ICMP_TYPE_SOURCE_QUENCH 4
+#define ICMP_TYPE_REDIRECT 5
+#define ICMP_TYPE_TIME_EXCEEDED 11
+#define ICMP_TYPE_PARAM_PROBLEM 12
+
+#define ICMP_CODE_NET_UNREACH 0
+#define ICMP_CODE_FRAG_NEEDED 4
+#define ICMP_CODE_REDIRECT_HOST 1
+#define ICMP_CODE_TTL_EXCEEDED 0
+
+#define ICMP_ERROR_RATE_MAX 100 /* error messages per second */
+
 struct ip_route {
   uint8_t used;
   ip_addr_t network;
@@ -30,7 +54,14 @@ struct ip_fragment {
   uint16_t len;
   uint8_t data[65535];
   uint32_t mask[2048];
-  time_t timestamp;
+  struct timer timer;  // expires IP_FRAGMENT_TIMEOUT_SEC after the last one
+};
+
+struct icmp_hdr {
+  uint8_t type;
+  uint8_t code;
+  uint16_t sum;
+  uint32_t values;  // next-hop MTU or gateway address by type
 };
 
 struct ip_protocol {
@@ -41,9 +72,14 @@ struct ip_protocol {
 };
 
 static struct netif *default_netif = NULL;
+static struct ip_route route_table[IP_ROUTE_TABLE_SIZE];
+static pthread_mutex_t route_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct ip_protocol *protocols = NULL;
 static struct ip_fragment *fragments = NULL;
+static size_t fragment_count = 0;
+static pthread_mutex_t fragment_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int ip_forwarding = 0;
+static struct ip_forward_stats forward_stats;
 
 const ip_addr_t IP_ADDR_ANY = 0x00000000;
 const ip_addr_t IPADDR_BROADCAST = 0xffffffff;
@@ -101,6 +137,8 @@ void ip_dump(struct netif *netif, struct ip_hdr *hdr, uint8_t *packet,
  * IP FRAGMENT
  */
 
+static void ip_fragment_timeout(void *arg);
+
 static struct ip_fragment *ip_fragment_alloc(struct ip_hdr *hdr) {
   struct ip_fragment *new_fragment;
 
@@ -116,6 +154,7 @@ static struct ip_fragment *ip_fragment_alloc(struct ip_hdr *hdr) {
   new_fragment->len = 0;
   memset(new_fragment->data, 0, sizeof(new_fragment->data));
   maskclr(new_fragment->mask, sizeof(new_fragment->mask));
+  timer_setup(&new_fragment->timer, ip_fragment_timeout, new_fragment);
   fragments = new_fragment;
   return new_fragment;
 }
@@ -152,61 +191,51 @@ static struct ip_fragment *ip_fragment_search(struct ip_hdr *hdr) {
   return NULL;
 }
 
-static int ip_fragment_patrol(void) {
-  time_t now;
-  struct ip_fragment *entry, *prev = NULL;
-  int count = 0;
+// runs on the timer thread. the fragment may have been completed and freed
+// while this timer was being dispatched, so look it up before touching it.
+static void ip_fragment_timeout(void *arg) {
+  struct ip_fragment *fragment;
 
-  now = time(NULL);
-  entry = fragments;
-  while (entry) {
-    if (now - entry->timestamp > IP_FRAGMENT_TIMEOUT_SEC) {
-      if (prev) {
-        entry = prev->next = entry->next;
-      } else {
-        entry = fragments = entry->next;
-      }
-      free(entry);
-      count++;
-      continue;
-    }
-    prev = entry;
-    entry = entry->next;
+  pthread_mutex_lock(&fragment_mutex);
+  fragment = ip_fragment_detach((struct ip_fragment *)arg);
+  if (fragment && timer_pending(&fragment->timer)) {
+    // re-armed by a new fragment while this timer was being dispatched
+    fragment->next = fragments;
+    fragments = fragment;
+    fragment = NULL;
+  }
+  if (fragment) {
+    fragment_count--;
+  }
+  pthread_mutex_unlock(&fragment_mutex);
+  if (fragment) {
+    ip_fragment_free(fragment);
   }
-  return count;
 }
 
 static struct ip_fragment *ip_fragment_process(struct ip_hdr *hdr,
                                                uint8_t *payload, size_t plen) {
   struct ip_fragment *fragment;
   uint16_t off;
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  static time_t timestamp = 0;
-  static size_t count = 0;
 
-  pthread_mutex_lock(&mutex);
-
-  // check fragment timeout
-  if (time(NULL) - timestamp > 10) {
-    ip_fragment_patrol();
-  }
+  pthread_mutex_lock(&fragment_mutex);
 
   // find or create fragment object
   fragment = ip_fragment_search(hdr);
   if (!fragment) {
-    if (count >= IP_FRAGMENT_NUM_MAX) {
+    if (fragment_count >= IP_FRAGMENT_NUM_MAX) {
       // too many fragments
-      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&fragment_mutex);
       return NULL;
     }
     // create new fragment object
     fragment = ip_fragment_alloc(hdr);
     if (!fragment) {
       // failed to allocate fragment object
-      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&fragment_mutex);
       return NULL;
     }
-    count++;
+    fragment_count++;
   }
 
   // copy data to fragment object
@@ -216,27 +245,92 @@ static struct ip_fragment *ip_fragment_process(struct ip_hdr *hdr,
   if ((ntoh16(hdr->offset) & 0x2000) == 0) {
     fragment->len = off + plen;
   }
-  fragment->timestamp = time(NULL);
+  timer_add(&fragment->timer, (uint64_t)IP_FRAGMENT_TIMEOUT_SEC * 1000000);
 
   // check fragment is completed
   if (!fragment->len) {
     // don't know total fragment length yet
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&fragment_mutex);
     return NULL;
   }
   if (!maskchk(fragment->mask, sizeof(fragment->mask), 0, fragment->len)) {
     // imcomplete fragments
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&fragment_mutex);
     return NULL;
   }
 
   // detach fragment object
   ip_fragment_detach(fragment);
-  count--;
-  pthread_mutex_unlock(&mutex);
+  timer_del(&fragment->timer);
+  fragment_count--;
+  pthread_mutex_unlock(&fragment_mutex);
   return fragment;
 }
 
+/*
+ * IP ROUTING
+ */
+
+// routes are only added. writers serialize on route_mutex, and a route is
+// filled in before used is set with release order, so that lookups on the
+// packet path see it complete without taking a lock.
+static int ip_route_add_core(ip_addr_t network, ip_addr_t netmask,
+                             ip_addr_t nexthop, struct netif *netif) {
+  struct ip_route *route;
+  int i;
+
+  pthread_mutex_lock(&route_mutex);
+  for (i = 0; i < IP_ROUTE_TABLE_SIZE; i++) {
+    route = &route_table[i];
+    if (!route->used) {
+      route->network = network & netmask;
+      route->netmask = netmask;
+      route->nexthop = nexthop;
+      route->netif = netif;
+      __atomic_store_n(&route->used, 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&route_mutex);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&route_mutex);
+  // route table is full
+  return -1;
+}
+
+// longest prefix match
+static struct ip_route *ip_route_lookup(const ip_addr_t *dst) {
+  struct ip_route *route, *candidate = NULL;
+  int i;
+
+  for (i = 0; i < IP_ROUTE_TABLE_SIZE; i++) {
+    route = &route_table[i];
+    if (__atomic_load_n(&route->used, __ATOMIC_ACQUIRE) &&
+        (*dst & route->netmask) == route->network) {
+      if (!candidate ||
+          ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
+        candidate = route;
+      }
+    }
+  }
+  return candidate;
+}
+
+int ip_route_add(const char *network, const char *netmask, const char *nexthop,
+                 struct netif *netif) {
+  ip_addr_t n, m, h = IP_ADDR_ANY;
+
+  if (!netif || netif->family != NETIF_FAMILY_IPV4) {
+    return -1;
+  }
+  if (ip_addr_pton(network, &n) == -1 || ip_addr_pton(netmask, &m) == -1) {
+    return -1;
+  }
+  if (nexthop && ip_addr_pton(nexthop, &h) == -1) {
+    return -1;
+  }
+  return ip_route_add_core(n, m, h, netif);
+}
+
 /*
  * IP INTERFACE
  */
@@ -262,16 +356,30 @@ struct netif *ip_netif_register(struct netdev *dev, const char *addr,
   }
   iface->network = iface->unicast & iface->netmask;
   iface->broadcast = iface->network | ~iface->netmask;
-
-  // TODO : register to route table
-  default_netif = (struct netif *)iface;
-  // TODO : set gateway
+  iface->gateway = IP_ADDR_ANY;
+  if (gateway && ip_addr_pton(gateway, &iface->gateway) == -1) {
+    goto ERR_SETUP_NETIF;
+  }
 
   // register netdev
   if (netdev_add_netif(dev, (struct netif *)iface) == -1) {
     goto ERR_SETUP_NETIF;
   }
 
+  // register to route table
+  if (ip_route_add_core(iface->network, iface->netmask, IP_ADDR_ANY,
+                        (struct netif *)iface) == -1) {
+    fprintf(stderr, "[warning] route table is full\n");
+  }
+  if (iface->gateway != IP_ADDR_ANY &&
+      ip_route_add_core(IP_ADDR_ANY, IP_ADDR_ANY, iface->gateway,
+                        (struct netif *)iface) == -1) {
+    fprintf(stderr, "[warning] route table is full\n");
+  }
+  if (!default_netif) {
+    default_netif = (struct netif *)iface;
+  }
+
   return (struct netif *)iface;
 
 ERR_SETUP_NETIF:
@@ -295,19 +403,201 @@ struct netif *ip_netif_by_addr(ip_addr_t *addr) {
 }
 
 struct netif *ip_netif_by_peer(ip_addr_t *peer) {
-  // TODO: find netif from routing table
+  struct ip_route *route;
 
-  return default_netif;
+  route = ip_route_lookup(peer);
+  if (!route) {
+    return default_netif;
+  }
+  return route->netif;
 }
 
 /*
  * IP CORE
  */
 
-static void ip_rx(uint8_t *dgram, size_t dlen, struct netdev *dev) {
+static int ip_tx_netdev(struct netif *netif, uint8_t *packet, size_t plen,
+                        const ip_addr_t *dst);
+
+// RFC 1624 incremental update. TTL is the upper octet of its 16-bit word, so
+// decrementing it adds 0x0100 to the checksum with end-around carry.
+static void ip_ttl_decrement(struct ip_hdr *hdr) {
+  uint32_t sum;
+
+  hdr->ttl--;
+  sum = ntoh16(hdr->sum) + 0x0100;
+  hdr->sum = hton16((uint16_t)(sum + (sum >> 16)));
+}
+
+// addresses which never belong to a single remote host: this network (0/8),
+// loopback (127/8), multicast (224/4) and reserved (240/4), which includes
+// limited broadcast
+static int ip_addr_special(ip_addr_t addr) {
+  uint8_t top;
+
+  top = ntoh32(addr) >> 24;
+  return top == 0 || top == 127 || top >= 224;
+}
+
+static int ip_icmp_error_limit(void) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static time_t timestamp;
+  static int count;
+  time_t now;
+  int ret = 0;
+
+  time(&now);
+  pthread_mutex_lock(&mutex);
+  if (timestamp != now) {
+    timestamp = now;
+    count = 0;
+  }
+  if (count >= ICMP_ERROR_RATE_MAX) {
+    ret = -1;
+  } else {
+    count++;
+  }
+  pthread_mutex_unlock(&mutex);
+  return ret;
+}
+
+// report an error about the received packet to its source, from the
+// interface it has arrived at. values are in network byte order.
+// no error is sent about an error, about a fragment but the first one, or
+// about a packet whose source is not a single host.
+// https://tools.ietf.org/html/rfc1812#section-4.3.2.7
+static void ip_icmp_error(struct netif *netif, uint8_t type, uint8_t code,
+                          uint32_t values, const struct ip_hdr *hdr,
+                          size_t len) {
+  uint8_t buf[sizeof(struct icmp_hdr) + IP_HDR_SIZE_MAX + 8];
+  struct icmp_hdr *icmp;
+  uint16_t hlen;
+  size_t dlen;
+  uint8_t orig;
+
+  hlen = (hdr->vhl & 0x0f) << 2;
+  if (ntoh16(hdr->offset) & IP_OFFSET_MASK || ip_addr_special(hdr->src) ||
+      hdr->src == ((struct netif_ip *)netif)->broadcast) {
+    return;
+  }
+  if (hdr->protocol == IP_PROTOCOL_ICMP && len > hlen) {
+    orig = ((const uint8_t *)hdr)[hlen];
+    if (orig == ICMP_TYPE_DEST_UNREACH || orig == ICMP_TYPE_SOURCE_QUENCH ||
+        orig == ICMP_TYPE_REDIRECT || orig == ICMP_TYPE_TIME_EXCEEDED ||
+        orig == ICMP_TYPE_PARAM_PROBLEM) {
+      return;
+    }
+  }
+  if (ip_icmp_error_limit() == -1) {
+    return;
+  }
+  // the header and the first 8 octets of data of the packet
+  // https://tools.ietf.org/html/rfc792
+  dlen = MIN(len, (size_t)hlen + 8);
+  icmp = (struct icmp_hdr *)buf;
+  icmp->type = type;
+  icmp->code = code;
+  icmp->sum = 0;
+  icmp->values = values;
+  memcpy(icmp + 1, hdr, dlen);
+  icmp->sum = cksum16((uint16_t *)buf, sizeof(*icmp) + dlen, 0);
+  ip_tx(netif, IP_PROTOCOL_ICMP, buf, sizeof(*icmp) + dlen, &hdr->src);
+}
+
+static int ip_tx_fragments(struct netif *netif, struct ip_hdr *hdr,
+                           uint16_t hlen, const uint8_t *buf, size_t len,
+                           const ip_addr_t *nexthop);
+
+// netif is the interface the packet has arrived at
+// https://tools.ietf.org/html/rfc1812#section-5.2
+static void ip_forward_process(struct netif *netif, struct ip_hdr *hdr,
+                               size_t len, uint16_t flags) {
+  struct netif_ip *iface;
+  struct ip_route *route;
+  ip_addr_t nexthop;
+  uint16_t hlen, mtu;
+  int ret;
+
+  iface = (struct netif_ip *)netif;
+  // not for a single host, or for this host as a link-layer broadcast
+  // https://tools.ietf.org/html/rfc1812#section-5.3.4
+  // https://tools.ietf.org/html/rfc1812#section-5.3.7
+  if (flags & NETDEV_RX_FLAG_BROADCAST || ip_addr_special(hdr->dst) ||
+      ip_addr_special(hdr->src) || hdr->src == iface->broadcast) {
+    __atomic_fetch_add(&forward_stats.not_forwardable, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "ip packet is not forwardable.\n");
+    return;
+  }
+  if (hdr->ttl <= 1) {
+    __atomic_fetch_add(&forward_stats.ttl_exceeded, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "ip packet was dead in forwarding (TTL=%u).\n", hdr->ttl);
+    ip_icmp_error(netif, ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_TTL_EXCEEDED, 0,
+                  hdr, len);
+    return;
+  }
+  route = ip_route_lookup(&hdr->dst);
+  if (!route) {
+    __atomic_fetch_add(&forward_stats.no_route, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "ip packet has no route to forward.\n");
+    ip_icmp_error(netif, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_NET_UNREACH, 0, hdr,
+                  len);
+    return;
+  }
+  // directed broadcast to an attached network isn't forwarded (RFC 2644)
+  if (hdr->dst == ((struct netif_ip *)route->netif)->broadcast) {
+    __atomic_fetch_add(&forward_stats.not_forwardable, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "ip packet is not forwardable.\n");
+    return;
+  }
+  nexthop = route->nexthop != IP_ADDR_ANY ? route->nexthop : hdr->dst;
+  mtu = route->netif->dev->mtu;
+  if (len > mtu && ntoh16(hdr->offset) & IP_FLAG_DF) {
+    // path MTU discovery of the source learns the MTU from this
+    // https://tools.ietf.org/html/rfc1191#section-4
+    __atomic_fetch_add(&forward_stats.frag_needed, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "ip packet is too big to forward (DF).\n");
+    ip_icmp_error(netif, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAG_NEEDED,
+                  hton32(mtu), hdr, len);
+    return;
+  }
+  if (route->netif == netif &&
+      (hdr->src & iface->netmask) == iface->network) {
+    // going back to the network it came from. the source can send to the
+    // nexthop directly. the packet is forwarded as well
+    // https://tools.ietf.org/html/rfc1812#section-5.2.7.2
+    __atomic_fetch_add(&forward_stats.redirected, 1, __ATOMIC_RELAXED);
+    ip_icmp_error(netif, ICMP_TYPE_REDIRECT, ICMP_CODE_REDIRECT_HOST, nexthop,
+                  hdr, len);
+  }
+  ip_ttl_decrement(hdr);
+
+#ifdef DEBUG
+  fprintf(stderr, ">>> ip_forward_process <<<\n");
+  ip_dump(route->netif, hdr, (uint8_t *)hdr, len);
+#endif
+
+  if (len > mtu) {
+    __atomic_fetch_add(&forward_stats.fragmented, 1, __ATOMIC_RELAXED);
+    hlen = (hdr->vhl & 0x0f) << 2;
+    ret = ip_tx_fragments(route->netif, hdr, hlen, (uint8_t *)hdr + hlen,
+                          len - hlen, &nexthop);
+  } else {
+    // the received packet is passed to the device as it is, without building
+    // another one. the device still copies it into its own frame
+    ret = ip_tx_netdev(route->netif, (uint8_t *)hdr, len, &nexthop);
+  }
+  if (ret == -1) {
+    __atomic_fetch_add(&forward_stats.tx_errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&forward_stats.forwarded, 1, __ATOMIC_RELAXED);
+}
+
+static void ip_rx(uint8_t *dgram, size_t dlen, struct netdev *dev,
+                  uint16_t flags) {
   struct ip_hdr *hdr;
   uint16_t hlen, offset;
-  struct netif_ip *iface;
+  struct netif_ip *iface, *local;
   uint8_t *payload;
   size_t plen;
   struct ip_fragment *fragment = NULL;
@@ -346,11 +636,18 @@ static void ip_rx(uint8_t *dgram, size_t dlen, struct netdev *dev) {
   }
   if (hdr->dst != iface->unicast) {
     if (hdr->dst != iface->broadcast && hdr->dst != IPADDR_BROADCAST) {
-      // for other host
-      if (ip_forwarding) {
-        // TOOD: ip_forward_process
+      local = (struct netif_ip *)ip_netif_by_addr(&hdr->dst);
+      if (!local) {
+        // for other host
+        if (ip_forwarding) {
+          ip_forward_process((struct netif *)iface, hdr, ntoh16(hdr->len),
+                             flags);
+        }
+        return;
       }
-      return;
+      // address of another interface of this host. it is delivered locally
+      // (weak end system model, RFC 1122 3.3.4.2)
+      iface = local;
     }
   }
 
@@ -408,30 +705,25 @@ static int ip_tx_netdev(struct netif *netif, uint8_t *packet, size_t plen,
   return 1;
 }
 
-static int ip_tx_core(struct netif *netif, uint8_t protocol, const uint8_t *buf,
-                      size_t len, const ip_addr_t *src, const ip_addr_t *dst,
-                      const ip_addr_t *nexthop, uint16_t id, uint16_t offset) {
+// hdr is a template of the header. its length and offset are set for each
+// packet
+static int ip_tx_core(struct netif *netif, const struct ip_hdr *tmpl,
+                      uint16_t hlen, const uint8_t *buf, size_t len,
+                      uint16_t offset, const ip_addr_t *nexthop) {
   uint8_t packet[4096];
   struct ip_hdr *hdr;
-  uint16_t hlen;
 
   // set header
   hdr = (struct ip_hdr *)packet;
-  hlen = sizeof(struct ip_hdr);
+  memcpy(hdr, tmpl, hlen);
   hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
-  hdr->tos = 0;
   hdr->len = hton16(hlen + len);
-  hdr->id = hton16(id);
   hdr->offset = hton16(offset);
-  hdr->ttl = 0xff;
-  hdr->protocol = protocol;
   hdr->sum = 0;
-  hdr->src = src ? *src : ((struct netif_ip *)netif)->unicast;
-  hdr->dst = *dst;
   hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
 
   // copy payload
-  memcpy(hdr + 1, buf, len);
+  memcpy(packet + hlen, buf, len);
 
 #ifdef DEBUG
   fprintf(stderr, ">>> ip_tx_core <<<\n");
@@ -441,6 +733,66 @@ static int ip_tx_core(struct netif *netif, uint8_t protocol, const uint8_t *buf,
   return ip_tx_netdev(netif, (uint8_t *)packet, hlen + len, nexthop);
 }
 
+// keep only the options copied into all fragments, for fragments but the
+// first one. returns the new header length
+// https://tools.ietf.org/html/rfc791#page-15
+static uint16_t ip_options_copied(struct ip_hdr *hdr, uint16_t hlen) {
+  uint8_t *opt, *end, *dst;
+  uint8_t olen;
+
+  opt = dst = hdr->options;
+  end = (uint8_t *)hdr + hlen;
+  while (opt < end && *opt != IP_OPT_EOL) {
+    if (*opt == IP_OPT_NOP) {
+      opt++;
+      continue;
+    }
+    if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+      // broken option. the rest is dropped
+      break;
+    }
+    olen = opt[1];
+    if (*opt & IP_OPT_COPIED) {
+      memmove(dst, opt, olen);
+      dst += olen;
+    }
+    opt += olen;
+  }
+  hlen = dst - (uint8_t *)hdr;
+  // pad with end of options to 32-bit boundary
+  while (hlen & 3) {
+    ((uint8_t *)hdr)[hlen++] = IP_OPT_EOL;
+  }
+  return hlen;
+}
+
+// send payload in packets fitting MTU of netif, with headers built from hdr.
+// offset and MF flag of hdr are kept, so that a forwarded fragment can be
+// fragmented again. options of hdr may be dropped by this.
+static int ip_tx_fragments(struct netif *netif, struct ip_hdr *hdr,
+                           uint16_t hlen, const uint8_t *buf, size_t len,
+                           const ip_addr_t *nexthop) {
+  uint16_t base, flag, offset;
+  size_t done, slen;
+
+  base = ntoh16(hdr->offset);
+  for (done = 0; done < len; done += slen) {
+    // payload of fragments but the last one is a multiple of 8 octets
+    slen = MIN(len - done, (size_t)(netif->dev->mtu - hlen) & ~(size_t)7);
+    flag = (done + slen) < len ? IP_FLAG_MF : base & IP_FLAG_MF;
+    offset = (base & IP_FLAG_DF) | flag |
+             (((base & IP_OFFSET_MASK) + (done >> 3)) & IP_OFFSET_MASK);
+    if (ip_tx_core(netif, hdr, hlen, buf + done, slen, offset, nexthop) ==
+        -1) {
+      return -1;
+    }
+    if (!done && hlen > IP_HDR_SIZE_MIN) {
+      hlen = ip_options_copied(hdr, hlen);
+    }
+  }
+  return 0;
+}
+
 static uint16_t ip_generate_id(void) {
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
   static uint16_t id = 128;
@@ -456,32 +808,51 @@ static uint16_t ip_generate_id(void) {
 
 ssize_t ip_tx(struct netif *netif, uint8_t protocol, const uint8_t *buf,
               size_t len, const ip_addr_t *dst) {
-  ip_addr_t *nexthop = NULL, *src = NULL;
-  uint16_t id, flag, offset;
-  size_t done, slen;
+  struct ip_route *route;
+  ip_addr_t *src = NULL, gateway;
+  const ip_addr_t *nexthop = NULL;
+  struct ip_hdr hdr;
+  uint16_t id;
 
   // determine nexthop
   if (netif && *dst == IPADDR_BROADCAST) {
     nexthop = NULL;
   } else {
-    // TODO: find route
-    if (netif) {
-      src = &((struct netif_ip *)netif)->unicast;
+    route = ip_route_lookup(dst);
+    if (!netif) {
+      if (!route) {
+        // no route to host
+        return -1;
+      }
+      netif = route->netif;
+    }
+    src = &((struct netif_ip *)netif)->unicast;
+    if (route && route->netif != netif) {
+      // source address of another interface. the packet leaves from the
+      // interface toward dst, as a reply to a packet received by it
+      netif = route->netif;
     }
-    // TODO: use route to determin nexthop
     nexthop = dst;
+    if (route && route->netif == netif && route->nexthop != IP_ADDR_ANY) {
+      gateway = route->nexthop;
+      nexthop = &gateway;
+    }
   }
   id = ip_generate_id();
 
+  // set header template
+  hdr.vhl = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+  hdr.tos = 0;
+  hdr.id = hton16(id);
+  hdr.offset = 0;
+  hdr.ttl = 0xff;
+  hdr.protocol = protocol;
+  hdr.src = src ? *src : ((struct netif_ip *)netif)->unicast;
+  hdr.dst = *dst;
+
   // send ip packet (if fragmented then sometimes)
-  for (done = 0; done < len; done += slen) {
-    slen = MIN((len - done), (size_t)(netif->dev->mtu - IP_HDR_SIZE_MIN));
-    flag = ((done + slen) < len) ? 0x2000 : 0x0000;
-    offset = flag | ((done >> 3) & 0x1fff);
-    if (ip_tx_core(netif, protocol, buf + done, slen, src, dst, nexthop, id,
-                   offset) == -1) {
-      return -1;
-    }
+  if (ip_tx_fragments(netif, &hdr, IP_HDR_SIZE_MIN, buf, len, nexthop) == -1) {
+    return -1;
   }
   return len;
 }
@@ -507,4 +878,29 @@ int ip_add_protocol(uint8_t protocol,
   return 0;
 }
 
-int ip_init(void) { return netdev_proto_register(NETDEV_PROTO_IP, ip_rx); }
+void ip_set_forwarding(int enable) { ip_forwarding = enable ? 1 : 0; }
+
+void ip_get_forward_stats(struct ip_forward_stats *stats) {
+  stats->forwarded =
+      __atomic_load_n(&forward_stats.forwarded, __ATOMIC_RELAXED);
+  stats->fragmented =
+      __atomic_load_n(&forward_stats.fragmented, __ATOMIC_RELAXED);
+  stats->redirected =
+      __atomic_load_n(&forward_stats.redirected, __ATOMIC_RELAXED);
+  stats->ttl_exceeded =
+      __atomic_load_n(&forward_stats.ttl_exceeded, __ATOMIC_RELAXED);
+  stats->no_route = __atomic_load_n(&forward_stats.no_route, __ATOMIC_RELAXED);
+  stats->frag_needed =
+      __atomic_load_n(&forward_stats.frag_needed, __ATOMIC_RELAXED);
+  stats->not_forwardable =
+      __atomic_load_n(&forward_stats.not_forwardable, __ATOMIC_RELAXED);
+  stats->tx_errors =
+      __atomic_load_n(&forward_stats.tx_errors, __ATOMIC_RELAXED);
+}
+
+int ip_init(void) {
+  if (timer_init() == -1) {
+    return -1;
+  }
+  return netdev_proto_register(NETDEV_PROTO_IP, ip_rx);
+}
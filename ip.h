@@ -46,6 +46,19 @@ struct netif_ip {
   ip_addr_t gateway;
 };
 
+// packets handled by forwarding. each drop is also logged, and reported to
+// the source by ICMP where it is allowed
+struct ip_forward_stats {
+  uint64_t forwarded;
+  uint64_t fragmented;       // forwarded in fragments
+  uint64_t redirected;       // forwarded back to the ingress with a redirect
+  uint64_t ttl_exceeded;     // dropped
+  uint64_t no_route;         // dropped
+  uint64_t frag_needed;      // dropped, too big with DF
+  uint64_t not_forwardable;  // dropped, not for a single remote host
+  uint64_t tx_errors;        // dropped by the egress
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IPADDR_BROADCAST;
 
@@ -56,6 +69,10 @@ struct netif *ip_netif_register(struct netdev *dev, const char *addr,
                                 const char *netmask, const char *gateway);
 struct netif *ip_netif_by_addr(ip_addr_t *addr);
 struct netif *ip_netif_by_peer(ip_addr_t *peer);
+int ip_route_add(const char *network, const char *netmask, const char *nexthop,
+                 struct netif *netif);
+void ip_set_forwarding(int enable);
+void ip_get_forward_stats(struct ip_forward_stats *stats);
 
 ssize_t ip_tx(struct netif *netif, uint8_t protocol, const uint8_t *buf,
               size_t len, const ip_addr_t *dst);
@@ -16,7 +16,8 @@ struct netdev_driver {
 struct netdev_proto {
   struct netdev_proto *next;
   uint16_t type;
-  void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev);
+  void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev,
+                  uint16_t flags);
 };
 
 static struct netdev_driver *drivers = NULL;
@@ -48,7 +49,7 @@ int netdev_driver_register(struct netdev_def *def) {
 
 int netdev_proto_register(unsigned short type,
                           void (*handler)(uint8_t *packet, size_t plen,
-                                          struct netdev *dev)) {
+                                          struct netdev *dev, uint16_t flags)) {
   struct netdev_proto *entry;
 
   // check this proto is already registered
@@ -70,12 +71,12 @@ int netdev_proto_register(unsigned short type,
 }
 
 static void netdev_rx_handler(struct netdev *dev, uint16_t type,
-                              uint8_t *packet, size_t plen) {
+                              uint8_t *packet, size_t plen, uint16_t flags) {
   struct netdev_proto *entry;
 
   for (entry = protos; entry; entry = entry->next) {
     if (hton16(entry->type) == type) {
-      entry->handler(packet, plen, dev);
+      entry->handler(packet, plen, dev, flags);
     }
   }
 }
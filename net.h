@@ -15,6 +15,8 @@
 #define NETDEV_FLAG_RUNNING (0x0040)
 #define NETDEV_FLAG_UP (0x0080)
 
+#define NETDEV_RX_FLAG_BROADCAST (0x0001) /* link-layer broadcast frame */
+
 #include "ethernet.h"
 #define NETDEV_PROTO_IP ETHERNET_TYPE_IP
 #define NETDEV_PROTO_ARP ETHERNET_TYPE_ARP
@@ -66,7 +68,7 @@ struct netdev {
   uint8_t peer[16];
   uint8_t broadcast[16];
   void (*rx_handler)(struct netdev *dev, uint16_t type, uint8_t *packet,
-                     size_t plen);
+                     size_t plen, uint16_t flags);
   struct netdev_ops *ops;
   void *priv;
 };
@@ -74,7 +76,7 @@ struct netdev {
 int netdev_driver_register(struct netdev_def *def);
 int netdev_proto_register(unsigned short type,
                           void (*handler)(uint8_t *packet, size_t plen,
-                                          struct netdev *dev));
+                                          struct netdev *dev, uint16_t flags));
 
 struct netdev *netdev_root(void);
 struct netdev *netdev_alloc(uint16_t type);
@@ -12,6 +12,8 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#define SOC_DEV_RX_BURST 32
+
 struct soc_dev {
   int fd;
 };
@@ -76,7 +78,7 @@ void soc_dev_rx(struct soc_dev *dev,
                 void (*callback)(uint8_t *, size_t, void *), void *arg,
                 int timeout) {
   struct pollfd pfd;
-  int ret;
+  int ret, n;
   ssize_t len;
   uint8_t buf[2048];
 
@@ -93,15 +95,20 @@ void soc_dev_rx(struct soc_dev *dev,
       return;
   }
 
-  len = read(dev->fd, buf, sizeof(buf));
-  switch (len) {
-    case -1:
-      perror("read");
-
-    case 0: /* EOF */
-      return;
+  // process frames arrived in this wakeup as a burst
+  for (n = 0; n < SOC_DEV_RX_BURST; n++) {
+    len = recv(dev->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    switch (len) {
+      case -1:
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("recv");
+        }
+
+      case 0: /* EOF */
+        return;
+    }
+    callback(buf, len, arg);
   }
-  callback(buf, len, arg);
 }
 
 ssize_t soc_dev_tx(struct soc_dev *dev, const uint8_t *buf, size_t len) {
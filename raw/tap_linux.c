@@ -13,6 +13,7 @@
 #include "raw/tap.h"
 
 #define CLONE_DEVICE "/dev/net/tun"
+#define TAP_DEV_RX_BURST 32
 
 struct tap_dev {
   int fd;
@@ -27,7 +28,8 @@ struct tap_dev *tap_dev_open(char *name) {
     fprintf(stderr, "malloc: failure\n");
     goto ERROR;
   }
-  dev->fd = open(CLONE_DEVICE, O_RDWR);
+  // non-blocking to drain all queued frames after poll
+  dev->fd = open(CLONE_DEVICE, O_RDWR | O_NONBLOCK);
   if (dev->fd == -1) {
     perror("open");
     goto ERROR;
@@ -60,7 +62,7 @@ void tap_dev_rx(struct tap_dev *dev,
                 void (*callback)(uint8_t *, size_t, void *), void *arg,
                 int timeout) {
   struct pollfd pfd;
-  int ret;
+  int ret, n;
   ssize_t len;
   uint8_t buf[2048];
 
@@ -77,15 +79,20 @@ void tap_dev_rx(struct tap_dev *dev,
       return;
   }
 
-  len = read(dev->fd, buf, sizeof(buf));
-  switch (len) {
-    case -1:
-      perror("read");
-
-    case 0: /* EOF */
-      return;
+  // process frames arrived in this wakeup as a burst
+  for (n = 0; n < TAP_DEV_RX_BURST; n++) {
+    len = read(dev->fd, buf, sizeof(buf));
+    switch (len) {
+      case -1:
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("read");
+        }
+
+      case 0: /* EOF */
+        return;
+    }
+    callback(buf, len, arg);
   }
-  callback(buf, len, arg);
 }
 
 ssize_t tap_dev_tx(struct tap_dev *dev, const uint8_t *buf, size_t len) {
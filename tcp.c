@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,14 +7,39 @@
 #include <time.h>
 #include <unistd.h>
 #include "ip.h"
+#include "tcp.h"
+#include "tcp_cc.h"
+#include "timer.h"
 #include "util.h"
 
 // TODO: user timeout should set by user
 #define USER_TIMEOUT (20)          /* user timeout (seconds) */
 #define TIME_WAIT_TIMEOUT (2 * 10) /* TIME_WAIT timeout (seconds) */
-#define TCP_SND_BUF_SIZE (10 * 1024)
-
-#define TCP_CB_TABLE_SIZE 128
+#define TCP_RTO_INIT (1000 * 1000)     /* initial RTO (usec) */
+#define TCP_RTO_MIN (200 * 1000)       /* lower bound of RTO (usec) */
+#define TCP_RTO_MAX (60 * 1000 * 1000) /* upper bound of RTO (usec) */
+#define TCP_RTO_GRANULARITY 100        /* clock granularity G of timer wheel */
+#define TCP_DUPACK_THRESH 3            /* duplicate acks to fast retransmit */
+#define TCP_DELACK_TIMEOUT (40 * 1000) /* default delayed ack timeout (usec) */
+#define TCP_DELACK_TIMEOUT_MAX (500 * 1000) /* RFC 1122 upper bound */
+#define TCP_QUICKACK_SEGS 16 /* segments acked at once in slow start */
+#define TCP_SACK_BLOCK_MAX 4           /* SACK blocks in a segment */
+#define TCP_OOO_RANGE_MAX 64 /* out-of-order ranges kept at once */
+#define TCP_SND_BUF_SIZE (256 * 1024) /* power of two */
+#define TCP_RCV_BUF_SIZE (256 * 1024) /* power of two */
+#define TCP_SND_LOWAT (TCP_SND_BUF_SIZE / 4) /* room to wake blocked sender */
+#define TCP_RCV_WSCALE 3 /* 65535 << 3 covers receive buffer */
+#define TCP_WSCALE_MAX 14
+#define TCP_DEFAULT_MSS 536 /* assumed if peer doesn't send MSS option */
+#define TCP_PAWS_IDLE (24 * 24 * 60 * 60) /* ts_recent expires (seconds) */
+#define TCP_BUF_POOL_MAX 64 /* drained buffers kept for reuse */
+
+#define TCP_CB_CHUNK_SIZE 1024 /* cbs allocated at once */
+#define TCP_CB_CHUNK_MAX 1024
+#define TCP_CONN_HASH_BITS_MIN 10
+#define TCP_CONN_HASH_BITS_MAX 20
+#define TCP_LISTEN_HASH_BITS 6
+#define TCP_LISTEN_HASH_SIZE (1 << TCP_LISTEN_HASH_BITS)
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
 
@@ -29,6 +55,14 @@
 #define TCP_CB_STATE_CLOSE_WAIT 9
 #define TCP_CB_STATE_LAST_ACK 10
 
+#define TCP_RECOVERY_NONE 0
+#define TCP_RECOVERY_FAST 1 /* triggered by duplicate acks or SACK */
+#define TCP_RECOVERY_LOSS 2 /* after retransmission timeout */
+
+#define TCP_CB_HASH_NONE 0
+#define TCP_CB_HASH_CONN 1
+#define TCP_CB_HASH_LISTEN 2
+
 #define TCP_FLG_FIN 0x01
 #define TCP_FLG_SYN 0x02
 #define TCP_FLG_RST 0x04
@@ -36,15 +70,38 @@
 #define TCP_FLG_ACK 0x10
 #define TCP_FLG_URG 0x20
 
+#define TCP_HDR_OPT_EOL 0
+#define TCP_HDR_OPT_NOP 1
+#define TCP_HDR_OPT_MSS 2
+#define TCP_HDR_OPT_WSCALE 3
+#define TCP_HDR_OPT_SACK_PERMITTED 4
+#define TCP_HDR_OPT_SACK 5
+#define TCP_HDR_OPT_TIMESTAMP 8
+#define TCP_HDR_OPT_TIMESTAMP_LEN 10
+#define TCP_HDR_OPT_LEN_MAX 40
+
 #define TCP_FLG_IS(x, y) (((x)&0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) (((x)&0x3f) & (y))
 
 #define TCP_HDR_LEN(hdr) (((hdr)->off >> 4) << 2)
 #define TCP_DATA_LEN(hdr, len) ((len)-TCP_HDR_LEN(hdr))
+// sequence space occupied by segment
+#define TCP_SEG_LEN(hdr, len)                               \
+  (TCP_DATA_LEN(hdr, len) +                                 \
+   (TCP_FLG_ISSET((hdr)->flg, TCP_FLG_SYN) ? 1 : 0) +       \
+   (TCP_FLG_ISSET((hdr)->flg, TCP_FLG_FIN) ? 1 : 0))
+// sequence numbers compared modulo 2^32
+// https://tools.ietf.org/html/rfc793#section-3.3
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+#define TCP_TXQ_SEG_LEN(txq)                                \
+  ((txq)->len + (TCP_FLG_ISSET((txq)->flg, TCP_FLG_SYN) ? 1 : 0) + \
+   (TCP_FLG_ISSET((txq)->flg, TCP_FLG_FIN) ? 1 : 0))
 
 #define IS_FREE_CB(cb) (!(cb)->used && (cb)->state == TCP_CB_STATE_CLOSED)
 
-#define TCP_SOCKET_INVALID(x) ((x) < 0 || (x) >= TCP_CB_TABLE_SIZE)
 
 #ifndef TCP_DEBUG
 #ifdef DEBUG
@@ -52,6 +109,11 @@
 #endif
 #endif
 
+#if (TCP_SND_BUF_SIZE & (TCP_SND_BUF_SIZE - 1)) || \
+    (TCP_RCV_BUF_SIZE & (TCP_RCV_BUF_SIZE - 1))
+#error "size of send and receive buffers must be a power of two"
+#endif
+
 struct tcp_hdr {
   uint16_t src;
   uint16_t dst;
@@ -64,20 +126,98 @@ struct tcp_hdr {
   uint16_t urg;
 };
 
+struct tcp_sack_block {
+  uint32_t start;
+  uint32_t end;
+};
+
+// out-of-order data in receive buffer
+struct tcp_ooo_range {
+  uint32_t start;
+  uint32_t end;
+  struct tcp_ooo_range *next;
+};
+
+// options of received segment
+struct tcp_opts {
+  uint16_t mss;  // 0 if not present
+  uint8_t wscale_ok;
+  uint8_t wscale;
+  uint8_t sack_permitted;
+  uint8_t sack_num;
+  struct tcp_sack_block sack[TCP_SACK_BLOCK_MAX];
+  uint8_t ts_ok;
+  uint32_t tsval;
+  uint32_t tsecr;
+};
+
+// sent segment. data is kept in send buffer until acked, and the segment is
+// built again from it on retransmission
 struct tcp_txq_entry {
-  struct tcp_hdr *segment;
-  uint16_t len;
+  uint32_t seq;
+  uint16_t len;  // data length
+  uint8_t flg;
   struct timeval timestamp;
+  uint8_t rexmt;  // number of retransmissions
+  // SACK scoreboard
+  uint8_t sacked;
+  uint8_t lost;
+  uint8_t retrans;  // retransmitted in current recovery
   struct tcp_txq_entry *next;
 };
 
 struct tcp_txq_head {
   struct tcp_txq_entry *head;
   struct tcp_txq_entry *tail;
-  uint16_t snt;
+  uint32_t snt;  // bytes in flight
+  // SACK scoreboard, updated as segments are sent, SACKed and acked.
+  // a NULL position means the head of the queue
+  uint32_t pipe;  // bytes in flight estimated from the scoreboard
+  uint32_t sacked;  // SACKed segments and bytes in the queue
+  uint32_t sacked_bytes;
+  struct tcp_txq_entry *lost;  // first segment not examined for loss yet
+  uint32_t lost_sacked;  // SACKed segments and bytes before it
+  uint32_t lost_sacked_bytes;
+  struct tcp_txq_entry *hole;  // no hole to retransmit is before it
+  struct tcp_txq_entry *mark;  // where marking by the last SACK block ended
+  struct tcp_sack_block blk[TCP_SACK_BLOCK_MAX];  // blocks marked last
+  uint8_t blk_num;
+};
+
+struct tcp_buf_pool {
+  uint8_t *bufs[TCP_BUF_POOL_MAX];
+  int num;
+  uint32_t size;
+  pthread_mutex_t mutex;
+};
+
+// user buffer lent by tcp_api_send_zc. it holds [seq, seq + len) of send
+// sequence space in place of send buffer until acked
+struct tcp_zc {
+  uint32_t seq;
+  uint32_t len;
+  const uint8_t *buf;
+  void (*done)(void *arg, int err);
+  void *arg;
+  int err;  // passed to done. -1 if connection is aborted
+  struct tcp_zc *next;
+};
+
+// timer restarted by segments. the deadline is moved under cb mutex, and the
+// timer on the wheel is touched only when it has to fire earlier. a timer
+// firing before the deadline re-arms itself for the rest, so that acks
+// don't serialize on the timer wheel.
+struct tcp_timer {
+  struct timer timer;
+  uint64_t deadline;  // usec of monotonic clock. 0 if not armed
 };
 
 struct tcp_cb {
+  // hash chain of connection or listener table. free list while cb is free
+  struct tcp_cb *hash_next;
+  struct tcp_cb **hash_pprev;
+  uint8_t hashed;  // TCP_CB_HASH_*
+  int id;          // socket descriptor
   uint8_t used;
   uint8_t state;
   struct netif *iface;
@@ -92,31 +232,154 @@ struct tcp_cb {
     uint16_t up;
     uint32_t wl1;
     uint32_t wl2;
-    uint16_t wnd;
+    uint32_t wnd;
+    uint8_t wscale;  // shift count of windows advertised by peer
+    uint32_t sml;    // end of the last small segment sent
+    uint32_t end;    // end of data written to send buffer
+    uint8_t fin;     // FIN is sent after the data in send buffer
   } snd;
   uint32_t iss;
   struct {
     uint32_t nxt;
     uint16_t up;
-    uint16_t wnd;
+    uint32_t wnd;
+    uint8_t wscale;  // shift count of our windows. 0 if not negotiated
+    uint32_t rd;     // next sequence number to be read by user
+    uint8_t fin;     // FIN has been received after the data
+    uint32_t adv;    // right edge of the window in the last ack sent
   } rcv;
   uint32_t irs;
+  uint16_t mss;  // negotiated segment size without options. 0 until SYN
+  // RTT estimation (RFC 6298) in usec. srtt is 0 until the first sample
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;  // includes backoff
+  uint32_t persist;  // interval of zero window probes. backed off like rto
+  struct tcp_cc cc;
+  // loss recovery (RFC 6582, RFC 6675)
+  uint8_t dupacks;
+  uint8_t recovering;  // TCP_RECOVERY_*
+  uint32_t recover;    // snd.nxt when loss was detected
+  uint8_t sack_ok;     // SACK is permitted by both sides
+  // out-of-order data sorted by sequence number, and the ranges of them
+  // changed most recently for SACK blocks, most recent first
+  struct tcp_ooo_range *ooo;
+  struct tcp_ooo_range *ooo_last;  // range extended last. search starts here
+  uint8_t ooo_num;
+  struct tcp_sack_block sack[TCP_SACK_BLOCK_MAX];
+  uint8_t sack_num;
+  // timestamps (RFC 7323)
+  uint8_t ts_ok;           // timestamps are sent by both sides
+  uint32_t ts_recent;      // timestamp to be echoed
+  time_t ts_recent_age;    // when ts_recent was updated (seconds)
+  // delayed ack (RFC 1122, RFC 5681)
+  uint32_t last_ack_sent;   // ack number of the last segment sent
+  uint32_t delack_bytes;    // in-order bytes received and not acked yet
+  uint32_t delack_timeout;  // usec. 0 acks every segment at once
+  uint8_t quickack;         // segments to be acked at once
+  // small segments are sent at once with nodelay, and held while corked
+  uint8_t nodelay;
+  uint8_t cork;
+  // calls fail with EAGAIN instead of waiting. connecting is set while
+  // non-blocking connect is in progress, until its result is reported
+  uint8_t nonblock;
+  uint8_t connecting;
   struct tcp_txq_head txq;
-  uint8_t window[65535];
+  // buffers indexed by sequence number. allocated while data is buffered
+  struct ring sndbuf;
+  struct ring rcvbuf;
+  struct tcp_zc *zc;  // lent buffers sorted by sequence number
+  uint32_t lent;      // bytes of receive buffer lent by tcp_api_recv_zc
   struct tcp_cb *parent;
-  struct queue_head backlog;
+  uint8_t backlogged;         // queued in backlog of parent
+  struct queue_head backlog;  // protected by mutex of listener
+  pthread_mutex_t mutex;
   pthread_cond_t cond;
-  long timeout;
+  // timers fire with cb unlocked and run under cb mutex. a callback does
+  // nothing if its deadline was moved or cancelled meanwhile.
+  struct tcp_timer rexmt_timer;     // retransmission
+  struct tcp_timer user_timer;      // user timeout while data is unacked
+  struct tcp_timer timewait_timer;  // 2MSL in TIME_WAIT
+  struct tcp_timer delack_timer;    // delayed ack
+  struct tcp_timer persist_timer;   // zero window probe
 };
 
-static struct tcp_cb cb_table[TCP_CB_TABLE_SIZE];
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_t timer_thread;
-static pthread_cond_t timer_cond;
+// cbs are allocated by chunk and never freed, so that pointers are stable
+// and socket descriptor is an index of chunks.
+// each cb is protected by its own mutex. table_mutex protects hash tables,
+// free list and port_refs, and is always taken after cb mutex.
+static struct tcp_cb *cb_chunks[TCP_CB_CHUNK_MAX];
+static int cb_chunk_num = 0;
+static struct tcp_cb **conn_table = NULL;  // (addr, port, peer)
+static int conn_hash_bits = 0;
+static size_t conn_num = 0;
+static struct tcp_cb *listen_table[TCP_LISTEN_HASH_SIZE];  // (addr, port)
+static struct tcp_cb *free_list = NULL;
+static uint32_t port_refs[65536];  // number of cbs using the local port
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct tcp_buf_pool snd_buf_pool = {.size = TCP_SND_BUF_SIZE,
+                                           .mutex = PTHREAD_MUTEX_INITIALIZER};
+static struct tcp_buf_pool rcv_buf_pool = {.size = TCP_RCV_BUF_SIZE,
+                                           .mutex = PTHREAD_MUTEX_INITIALIZER};
+// lent buffers to be returned to user. zc_mutex is taken after cb mutex
+static struct tcp_zc *zc_done = NULL;
+static struct tcp_zc **zc_done_tail = &zc_done;
+static pthread_mutex_t zc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static ssize_t tcp_tx(struct tcp_cb *cb, uint32_t seq, uint32_t ack,
-                      uint8_t flg, struct timeval *now, uint8_t *buf,
-                      size_t len);
+                      uint8_t flg, struct timeval *now, size_t len);
+static void tcp_rexmt_timeout(void *arg);
+static void tcp_user_timeout(void *arg);
+static void tcp_timewait_timeout(void *arg);
+static void tcp_delack_timeout(void *arg);
+static void tcp_persist_timeout(void *arg);
+
+static uint64_t tcp_timer_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// must be called with cb mutex. (re)arms the timer to fire after usec
+static void tcp_timer_set(struct tcp_timer *t, uint64_t usec) {
+  uint64_t deadline;
+
+  deadline = tcp_timer_now() + usec;
+  if (!t->deadline || deadline < t->deadline) {
+    timer_add(&t->timer, usec);
+  }
+  t->deadline = deadline;
+}
+
+// must be called with cb mutex. the timer left on the wheel finds no deadline
+// and does nothing
+static void tcp_timer_cancel(struct tcp_timer *t) { t->deadline = 0; }
+
+// must be called with cb mutex. takes the timer off the wheel as well
+static void tcp_timer_stop(struct tcp_timer *t) {
+  t->deadline = 0;
+  timer_del(&t->timer);
+}
+
+static int tcp_timer_armed(struct tcp_timer *t) { return t->deadline != 0; }
+
+// must be called with cb mutex by the callback. returns 1 if the deadline
+// has come, and the timer is not armed any more
+static int tcp_timer_expired(struct tcp_timer *t) {
+  uint64_t now;
+
+  if (!t->deadline) {
+    return 0;
+  }
+  now = tcp_timer_now();
+  if (now < t->deadline) {
+    timer_add(&t->timer, t->deadline - now);
+    return 0;
+  }
+  t->deadline = 0;
+  return 1;
+}
 
 static char *tcp_flg_ntop(uint8_t flg, char *buf, int len) {
   int i = 0;
@@ -186,77 +449,1240 @@ static void tcp_state_dump(struct tcp_cb *cb) {
   fprintf(stderr, "   txq.snt: %u\n", cb->txq.snt);
   fprintf(stderr, "   rcv.nxt: %u\n", cb->rcv.nxt);
   fprintf(stderr, "   rcv.wnd: %u\n", cb->rcv.wnd);
+  fprintf(stderr, "      srtt: %u\n", cb->srtt);
+  fprintf(stderr, "       rto: %u\n", cb->rto);
+  fprintf(stderr, "      cwnd: %u\n", cb->cc.cwnd);
+  fprintf(stderr, "  ssthresh: %u\n", cb->cc.ssthresh);
   fprintf(stderr, " n_backlog: %u\n", cb->backlog.num);
-  fprintf(stderr, "   timeout: %ld\n", cb->timeout);
 }
 
-static void tcp_dump(struct tcp_cb *cb, struct tcp_hdr *hdr, size_t plen) {
-  char buf[64];
+static void tcp_dump(struct tcp_cb *cb, struct tcp_hdr *hdr, size_t plen) {
+  char buf[64];
+
+  tcp_state_dump(cb);
+  fprintf(stderr, " len: %lu\n", plen);
+  fprintf(stderr, " src: %u\n", ntoh16(hdr->src));
+  fprintf(stderr, " dst: %u\n", ntoh16(hdr->dst));
+  fprintf(stderr, " seq: %u\n", ntoh32(hdr->seq));
+  fprintf(stderr, " ack: %u\n", ntoh32(hdr->ack));
+  fprintf(stderr, " off: %u\n", hdr->off);
+  fprintf(stderr, " flg: [%s]\n", tcp_flg_ntop(hdr->flg, buf, 64));
+  fprintf(stderr, " win: %u\n", ntoh16(hdr->win));
+  fprintf(stderr, " sum: %u\n", ntoh16(hdr->sum));
+  fprintf(stderr, " urg: %u\n", ntoh16(hdr->urg));
+}
+
+static uint16_t tcp_checksum(ip_addr_t self, ip_addr_t peer, uint8_t *segment,
+                             size_t len) {
+  uint32_t pseudo = 0;
+
+  pseudo += (self >> 16) & 0xffff;
+  pseudo += self & 0xffff;
+  pseudo += (peer >> 16) & 0xffff;
+  pseudo += self & 0xffff;
+  pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
+  pseudo += hton16(len);
+  return cksum16((uint16_t *)segment, len, pseudo);
+}
+
+// largest segment the interface carries without fragmentation. ip_tx
+// doesn't put IP options
+static uint16_t tcp_iface_mss(struct netif *iface) {
+  return iface->dev->mtu - IP_HDR_SIZE_MIN - sizeof(struct tcp_hdr);
+}
+
+// data size of a segment. options sent on every segment are taken from
+// the negotiated size (RFC 6691). mtu may changes, so calc size each time
+static uint32_t tcp_cb_mss(struct tcp_cb *cb) {
+  uint32_t mss;
+
+  mss = tcp_iface_mss(cb->iface);
+  if (cb->mss) {
+    mss = MIN(mss, cb->mss);
+  }
+  if (cb->ts_ok) {
+    mss -= TCP_HDR_OPT_TIMESTAMP_LEN + 2;
+  }
+  return mss;
+}
+
+// window field of outgoing segment. window of SYN is never scaled
+// https://tools.ietf.org/html/rfc7323#section-2.2
+static uint16_t tcp_cb_adv_wnd(struct tcp_cb *cb, uint8_t flg) {
+  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+    return MIN(cb->rcv.wnd, 65535);
+  }
+  return MIN(cb->rcv.wnd >> cb->rcv.wscale, 65535);
+}
+
+// in-order data which is not read by user yet. FIN takes the sequence number
+// after the data
+static uint32_t tcp_rcv_unread(struct tcp_cb *cb) {
+  return cb->rcv.nxt - cb->rcv.rd - cb->rcv.fin;
+}
+
+// open receive window after user read data. the right edge moves only by a
+// full segment or half of buffer beyond the one peer knows, so that peer
+// isn't invited to send small segments (receiver SWS avoidance, RFC 1122
+// 4.2.3.3). an update is sent at once when the window peer knows is doubled,
+// since peer may be stalled by it
+static void tcp_rcv_wnd_open(struct tcp_cb *cb, struct timeval *now) {
+  uint32_t wnd, adv;
+
+  wnd = TCP_RCV_BUF_SIZE - tcp_rcv_unread(cb);
+  // window left to peer by the last ack sent
+  adv = SEQ_GT(cb->rcv.adv, cb->rcv.nxt) ? cb->rcv.adv - cb->rcv.nxt : 0;
+  if (wnd < adv + MIN(TCP_RCV_BUF_SIZE / 2, tcp_cb_mss(cb))) {
+    return;
+  }
+  cb->rcv.wnd = wnd;
+  if (!cb->rcv.fin &&
+      ((uint32_t)tcp_cb_adv_wnd(cb, TCP_FLG_ACK) << cb->rcv.wscale) >=
+          2 * adv) {
+#ifdef TCP_DEBUG
+    fprintf(stderr, ">>> window update (%u) <<<\n", cb->rcv.wnd);
+#endif
+    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, now, 0);
+  }
+}
+
+// bytes allowed in flight by both peer and congestion control
+static uint32_t tcp_cb_snd_wnd(struct tcp_cb *cb) {
+  return MIN(cb->snd.wnd, cb->cc.cwnd);
+}
+
+/*
+ * Options
+ */
+
+// timestamp clock ticks every millisecond. it is monotonic, since a step of
+// the wall clock would make peer's PAWS drop our segments
+static uint32_t tcp_ts_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// build options of outgoing segment into opt and returns its length.
+// SACK blocks are put only on pure acks, which are never retransmitted.
+static size_t tcp_opts_build(struct tcp_cb *cb, uint8_t flg, size_t len,
+                             struct timeval *now, uint8_t *opt) {
+  size_t optlen = 0;
+  uint32_t edge, ts;
+  uint16_t mss;
+  int i, num;
+
+  if (cb->ts_ok ||
+      (TCP_FLG_ISSET(flg, TCP_FLG_SYN) && !TCP_FLG_ISSET(flg, TCP_FLG_ACK))) {
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_TIMESTAMP;
+    opt[optlen++] = TCP_HDR_OPT_TIMESTAMP_LEN;
+    ts = hton32(tcp_ts_now());
+    memcpy(opt + optlen, &ts, 4);
+    ts = hton32(cb->ts_recent);
+    memcpy(opt + optlen + 4, &ts, 4);
+    optlen += 8;
+  }
+  if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+    // MSS is always sent on SYN
+    opt[optlen++] = TCP_HDR_OPT_MSS;
+    opt[optlen++] = 4;
+    mss = hton16(tcp_iface_mss(cb->iface));
+    memcpy(opt + optlen, &mss, 2);
+    optlen += 2;
+    // offer options on SYN, and accept them on SYN-ACK only if peer offered
+    if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK) || cb->rcv.wscale) {
+      opt[optlen++] = TCP_HDR_OPT_NOP;
+      opt[optlen++] = TCP_HDR_OPT_WSCALE;
+      opt[optlen++] = 3;
+      opt[optlen++] = TCP_RCV_WSCALE;
+    }
+    if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK) || cb->sack_ok) {
+      opt[optlen++] = TCP_HDR_OPT_NOP;
+      opt[optlen++] = TCP_HDR_OPT_NOP;
+      opt[optlen++] = TCP_HDR_OPT_SACK_PERMITTED;
+      opt[optlen++] = 2;
+    }
+  } else if (cb->sack_ok && cb->sack_num && len == 0 &&
+             TCP_FLG_IS(flg, TCP_FLG_ACK)) {
+    // https://tools.ietf.org/html/rfc2018#section-3
+    // as many recent blocks as the remaining option space allows
+    num = MIN(cb->sack_num, (TCP_HDR_OPT_LEN_MAX - optlen - 4) / 8);
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_SACK;
+    opt[optlen++] = 2 + 8 * num;
+    for (i = 0; i < num; i++) {
+      edge = hton32(cb->sack[i].start);
+      memcpy(opt + optlen, &edge, 4);
+      edge = hton32(cb->sack[i].end);
+      memcpy(opt + optlen + 4, &edge, 4);
+      optlen += 8;
+    }
+  }
+  return optlen;
+}
+
+// unknown options are skipped and malformed ones end parsing
+static void tcp_opts_parse(struct tcp_hdr *hdr, struct tcp_opts *opts) {
+  uint8_t *opt, *end;
+  uint32_t edge;
+  int i;
+
+  memset(opts, 0, sizeof(*opts));
+  opt = (uint8_t *)(hdr + 1);
+  end = (uint8_t *)hdr + TCP_HDR_LEN(hdr);
+  while (opt < end) {
+    if (opt[0] == TCP_HDR_OPT_EOL) {
+      break;
+    }
+    if (opt[0] == TCP_HDR_OPT_NOP) {
+      opt++;
+      continue;
+    }
+    if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+      break;
+    }
+    switch (opt[0]) {
+      case TCP_HDR_OPT_MSS:
+        if (opt[1] == 4) {
+          opts->mss = opt[2] << 8 | opt[3];
+        }
+        break;
+
+      case TCP_HDR_OPT_WSCALE:
+        if (opt[1] == 3) {
+          opts->wscale_ok = 1;
+          opts->wscale = MIN(opt[2], TCP_WSCALE_MAX);
+        }
+        break;
+
+      case TCP_HDR_OPT_SACK_PERMITTED:
+        opts->sack_permitted = 1;
+        break;
+
+      case TCP_HDR_OPT_TIMESTAMP:
+        if (opt[1] == TCP_HDR_OPT_TIMESTAMP_LEN) {
+          opts->ts_ok = 1;
+          memcpy(&edge, opt + 2, 4);
+          opts->tsval = ntoh32(edge);
+          memcpy(&edge, opt + 6, 4);
+          opts->tsecr = ntoh32(edge);
+        }
+        break;
+
+      case TCP_HDR_OPT_SACK:
+        for (i = 0; i < (opt[1] - 2) / 8 && i < TCP_SACK_BLOCK_MAX; i++) {
+          memcpy(&edge, opt + 2 + 8 * i, 4);
+          opts->sack[i].start = ntoh32(edge);
+          memcpy(&edge, opt + 6 + 8 * i, 4);
+          opts->sack[i].end = ntoh32(edge);
+        }
+        opts->sack_num = i;
+        break;
+    }
+    opt += opt[1];
+  }
+}
+
+// segment size is the smaller of ours and what peer can receive
+static void tcp_mss_set(struct tcp_cb *cb, struct tcp_opts *opts) {
+  cb->mss = MIN(tcp_iface_mss(cb->iface),
+                opts->mss ? opts->mss : TCP_DEFAULT_MSS);
+}
+
+// window scaling is in effect only if both SYNs have the option
+static void tcp_wscale_set(struct tcp_cb *cb, struct tcp_opts *opts) {
+  if (opts->wscale_ok) {
+    cb->snd.wscale = opts->wscale;
+    cb->rcv.wscale = TCP_RCV_WSCALE;
+  } else {
+    cb->snd.wscale = cb->rcv.wscale = 0;
+  }
+}
+
+// timestamps are sent on every segment if both SYNs have the option
+static void tcp_ts_set(struct tcp_cb *cb, struct tcp_opts *opts,
+                       struct timeval *now) {
+  cb->ts_ok = opts->ts_ok;
+  cb->ts_recent = opts->tsval;
+  cb->ts_recent_age = now->tv_sec;
+}
+
+/*
+ * Buffers
+ */
+
+// attach a buffer of the pool to ring, if it has none
+static int tcp_buf_get(struct tcp_buf_pool *pool, struct ring *ring) {
+  uint8_t *buf = NULL;
+
+  if (ring->buf) {
+    return 0;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->num > 0) {
+    buf = pool->bufs[--pool->num];
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if (!buf && !(buf = malloc(pool->size))) {
+    return -1;
+  }
+  ring->buf = buf;
+  ring->mask = pool->size - 1;
+  return 0;
+}
+
+// idle connections don't hold buffers. data is indexed by sequence number,
+// so nothing has to be kept in the buffer when it is detached
+static void tcp_buf_put(struct tcp_buf_pool *pool, struct ring *ring) {
+  if (!ring->buf) {
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->num < TCP_BUF_POOL_MAX) {
+    pool->bufs[pool->num++] = ring->buf;
+    ring->buf = NULL;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  free(ring->buf);
+  ring->buf = NULL;
+}
+
+// copy data in send sequence space. lent buffers are read in place and the
+// rest comes from send buffer
+static void tcp_snd_read(struct tcp_cb *cb, uint32_t seq, uint8_t *data,
+                         size_t len) {
+  struct tcp_zc *zc;
+  size_t n;
+
+  for (zc = cb->zc; zc && len; zc = zc->next) {
+    if (SEQ_LT(seq, zc->seq)) {
+      n = MIN(len, zc->seq - seq);
+      ring_read(&cb->sndbuf, seq, data, n);
+      seq += n;
+      data += n;
+      len -= n;
+    }
+    if (len && SEQ_LT(seq, zc->seq + zc->len)) {
+      n = MIN(len, zc->seq + zc->len - seq);
+      memcpy(data, zc->buf + (seq - zc->seq), n);
+      seq += n;
+      data += n;
+      len -= n;
+    }
+  }
+  if (len) {
+    ring_read(&cb->sndbuf, seq, data, len);
+  }
+}
+
+// move lent buffers which are acked, or all of them if err, to the list to
+// be returned to user by tcp_zc_notify
+static void tcp_zc_complete(struct tcp_cb *cb, int err) {
+  struct tcp_zc *zc;
+
+  while ((zc = cb->zc) && (err || SEQ_LEQ(zc->seq + zc->len, cb->snd.una))) {
+    cb->zc = zc->next;
+    zc->err = err;
+    zc->next = NULL;
+    pthread_mutex_lock(&zc_mutex);
+    __atomic_store_n(zc_done_tail, zc, __ATOMIC_RELEASE);
+    zc_done_tail = &zc->next;
+    pthread_mutex_unlock(&zc_mutex);
+  }
+}
+
+// call done callbacks of returned buffers. it must be called without cb
+// mutex, so that callbacks can use sockets
+static void tcp_zc_notify(void) {
+  struct tcp_zc *zc, *next;
+
+  if (!__atomic_load_n(&zc_done, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_mutex_lock(&zc_mutex);
+  zc = zc_done;
+  __atomic_store_n(&zc_done, NULL, __ATOMIC_RELEASE);
+  zc_done_tail = &zc_done;
+  pthread_mutex_unlock(&zc_mutex);
+  for (; zc; zc = next) {
+    next = zc->next;
+    zc->done(zc->arg, zc->err);
+    free(zc);
+  }
+}
+
+/*
+ * Segment Queue
+ */
+
+static struct tcp_txq_entry *tcp_txq_add(struct tcp_cb *cb, uint32_t seq,
+                                         uint8_t flg, size_t len) {
+  struct tcp_txq_entry *txq;
+
+  txq = malloc(sizeof(struct tcp_txq_entry));
+  if (!txq) {
+    return NULL;
+  }
+  txq->seq = seq;
+  txq->len = len;
+  txq->flg = flg;
+  // clear timestamp
+  memset(&txq->timestamp, 0, sizeof(txq->timestamp));
+  txq->rexmt = 0;
+  txq->sacked = txq->lost = txq->retrans = 0;
+  txq->next = NULL;
+  // set txq to next of tail entry
+  if (cb->txq.head == NULL) {
+    cb->txq.head = txq;
+  } else {
+    cb->txq.tail->next = txq;
+  }
+  // update tail entry
+  cb->txq.tail = txq;
+
+  return txq;
+}
+
+static void tcp_txq_clear_all(struct tcp_cb *cb) {
+  struct tcp_txq_entry *txq = cb->txq.head, *next;
+  while (txq) {
+    next = txq->next;
+    free(txq);
+    txq = next;
+  }
+  memset(&cb->txq, 0, sizeof(cb->txq));
+}
+
+// bytes of the segment counted in pipe
+// https://tools.ietf.org/html/rfc6675#section-4
+static uint32_t tcp_txq_pipe(struct tcp_txq_entry *txq) {
+  if (txq->sacked) {
+    return 0;
+  }
+  return (txq->lost ? 0 : txq->len) + (txq->retrans ? txq->len : 0);
+}
+
+// the first len bytes of the segment at the head of queue are acked, and
+// whole is set if the segment is removed. SACKed bytes in them leave the
+// scoreboard
+static void tcp_sack_forget(struct tcp_cb *cb, struct tcp_txq_entry *txq,
+                            uint32_t len, int whole) {
+  if (!txq->sacked) {
+    return;
+  }
+  cb->txq.sacked_bytes -= len;
+  if (cb->txq.lost && cb->txq.lost != txq) {
+    cb->txq.lost_sacked_bytes -= len;
+  }
+  if (whole) {
+    cb->txq.sacked--;
+    if (cb->txq.lost && cb->txq.lost != txq) {
+      cb->txq.lost_sacked--;
+    }
+  }
+}
+
+// (re)send segment in txq with current ack number
+static void tcp_txq_xmit(struct tcp_cb *cb, struct tcp_txq_entry *txq,
+                         struct timeval *now) {
+  tcp_tx(cb, txq->seq, cb->rcv.nxt, txq->flg, now, txq->len);
+  if (!txq->timestamp.tv_sec) {
+    cb->txq.snt += txq->len;
+    cb->txq.pipe += txq->len;
+    if (txq->len < tcp_cb_mss(cb)) {
+      cb->snd.sml = txq->seq + TCP_TXQ_SEG_LEN(txq);
+    }
+  } else {
+    txq->rexmt++;
+  }
+  txq->timestamp = *now;
+}
+
+// send SYN, which is retransmitted until acked like data
+static int tcp_txq_syn(struct tcp_cb *cb, uint8_t flg, struct timeval *now) {
+  struct tcp_txq_entry *txq;
+
+  txq = tcp_txq_add(cb, cb->iss, flg, 0);
+  if (!txq) {
+    return -1;
+  }
+  tcp_txq_xmit(cb, txq, now);
+  if (!tcp_timer_armed(&cb->rexmt_timer)) {
+    tcp_timer_set(&cb->rexmt_timer, cb->rto);
+  }
+  return 0;
+}
+
+// room for user data in send buffer. lent buffers take sequence space of
+// send buffer too, and may be larger than it
+static uint32_t tcp_snd_space(struct tcp_cb *cb) {
+  uint32_t used;
+
+  used = cb->snd.end - cb->snd.una;
+  return used < TCP_SND_BUF_SIZE ? TCP_SND_BUF_SIZE - used : 0;
+}
+
+// data in send buffer which is not sent yet
+static uint32_t tcp_snd_unsent(struct tcp_cb *cb) {
+  return SEQ_LT(cb->snd.nxt, cb->snd.end) ? cb->snd.end - cb->snd.nxt : 0;
+}
+
+// cut a new segment from send buffer and send it, if it fits in wnd bytes
+// in flight. FIN follows all the data. returns 1 if sent.
+// a segment smaller than mss waits for more data while a small segment sent
+// before is unacknowledged (Nagle algorithm, RFC 896, in Minshall's variant
+// so that bulk transfer isn't delayed) or while corked. a segment is
+// shortened to the window only if it fills a good part of the window
+// (sender SWS avoidance, RFC 1122 4.2.3.4)
+static int tcp_txq_send_new(struct tcp_cb *cb, uint32_t wnd,
+                            struct timeval *now) {
+  struct tcp_txq_entry *txq;
+  uint32_t unsent, usable, len, mss;
+  uint8_t flg = TCP_FLG_ACK;
+
+  unsent = tcp_snd_unsent(cb);
+  if (!unsent) {
+    if (!cb->snd.fin || cb->snd.nxt != cb->snd.end) {
+      return 0;
+    }
+    flg |= TCP_FLG_FIN;
+  } else {
+    mss = tcp_cb_mss(cb);
+    usable = wnd > cb->txq.snt ? wnd - cb->txq.snt : 0;
+    len = MIN(unsent, mss);
+    if (len > usable) {
+      if (!usable || usable < wnd / 2) {
+        return 0;
+      }
+      len = usable;
+    }
+    if (len < mss && len == unsent && !cb->snd.fin &&
+        (cb->cork || (!cb->nodelay && SEQ_LT(cb->snd.una, cb->snd.sml)))) {
+      return 0;
+    }
+    if (len == unsent) {
+      flg |= TCP_FLG_PSH;
+    }
+    unsent = len;
+  }
+  txq = tcp_txq_add(cb, cb->snd.nxt, flg, unsent);
+  if (!txq) {
+    return 0;
+  }
+#ifdef TCP_DEBUG
+  fprintf(stderr, ">>> tcp_tx from txq <<<\n");
+#endif
+  tcp_txq_xmit(cb, txq, now);
+  cb->snd.nxt += TCP_TXQ_SEG_LEN(txq);
+  return 1;
+}
+
+// our FIN has been acked. it follows the last byte in send buffer
+static int tcp_fin_acked(struct tcp_cb *cb, uint32_t ack) {
+  return cb->snd.fin && ack == cb->snd.end + 1;
+}
+
+// send data in send buffer while sliding send window allows
+static void tcp_txq_output(struct tcp_cb *cb, struct timeval *now) {
+  int sent = 0;
+
+  while (tcp_txq_send_new(cb, tcp_cb_snd_wnd(cb), now)) {
+    sent = 1;
+  }
+  if (sent && !tcp_timer_armed(&cb->rexmt_timer)) {
+    tcp_timer_set(&cb->rexmt_timer, cb->rto);
+  }
+  // with nothing in flight, no ack will tell that peer's window opened.
+  // a stale timer is harmless since its callback checks this again
+  if (!cb->txq.head && tcp_snd_unsent(cb) && !cb->snd.wnd &&
+      !tcp_timer_armed(&cb->persist_timer)) {
+    cb->persist = cb->rto;
+    tcp_timer_set(&cb->persist_timer, cb->persist);
+  }
+}
+
+// update SRTT, RTTVAR and RTO with a round-trip time sample
+// https://tools.ietf.org/html/rfc6298#section-2
+static void tcp_rtt_update(struct tcp_cb *cb, uint32_t rtt) {
+  uint32_t delta;
+
+  if (!cb->srtt) {
+    cb->srtt = rtt ? rtt : 1;
+    cb->rttvar = rtt / 2;
+  } else {
+    delta = cb->srtt > rtt ? cb->srtt - rtt : rtt - cb->srtt;
+    cb->rttvar = (3 * cb->rttvar + delta) / 4;
+    cb->srtt = (7 * cb->srtt + rtt) / 8;
+  }
+  // a valid sample also clears backoff
+  cb->rto = cb->srtt + MAX(TCP_RTO_GRANULARITY, 4 * cb->rttvar);
+  cb->rto = MIN(MAX(cb->rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+// snd.una is advanced. remove acknowledged segments and restart
+// retransmission timer for the rest
+static void tcp_txq_acked(struct tcp_cb *cb, struct tcp_opts *opts,
+                          struct timeval *now) {
+  struct tcp_txq_entry *txq;
+  struct timeval sent = {}, diff;
+  int sample = 0;
+  uint32_t acked = 0, len;
+
+  while ((txq = cb->txq.head) && SEQ_LT(txq->seq, cb->snd.una)) {
+    if (SEQ_GT(txq->seq + TCP_TXQ_SEG_LEN(txq), cb->snd.una)) {
+      // partially acked. the rest is retransmitted from send buffer
+      len = cb->snd.una - txq->seq;
+      tcp_sack_forget(cb, txq, len, 0);
+      cb->txq.pipe -= tcp_txq_pipe(txq);
+      txq->seq += len;
+      txq->len -= len;
+      cb->txq.pipe += tcp_txq_pipe(txq);
+      cb->txq.snt -= len;
+      acked += len;
+      break;
+    }
+    cb->txq.pipe -= tcp_txq_pipe(txq);
+    tcp_sack_forget(cb, txq, txq->len, 1);
+    cb->txq.snt -= txq->len;
+    acked += txq->len;
+    // Karn's algorithm: retransmitted segments are ambiguous
+    sample = !txq->rexmt;
+    sent = txq->timestamp;
+    cb->txq.head = txq->next;
+    if (!txq->next) {
+      // txq is tail entry
+      cb->txq.tail = NULL;
+    }
+    // scoreboard positions at it move to the new head
+    if (cb->txq.lost == txq) {
+      cb->txq.lost = NULL;
+    }
+    if (cb->txq.hole == txq) {
+      cb->txq.hole = NULL;
+    }
+    if (cb->txq.mark == txq) {
+      cb->txq.mark = NULL;
+    }
+    free(txq);
+  }
+  tcp_zc_complete(cb, 0);
+  if (!cb->txq.head && !tcp_snd_unsent(cb)) {
+    tcp_buf_put(&snd_buf_pool, &cb->sndbuf);
+  }
+  if (sample) {
+    timersub(now, &sent, &diff);
+    tcp_rtt_update(cb, diff.tv_sec * 1000000 + diff.tv_usec);
+  } else if (cb->ts_ok && opts->ts_ok && opts->tsecr) {
+    // RTTM: echoed timestamp gives a sample even for retransmitted
+    // segments, though only in milliseconds
+    // https://tools.ietf.org/html/rfc7323#section-4.1
+    tcp_rtt_update(cb, (tcp_ts_now() - opts->tsecr) * 1000);
+  }
+  cb->dupacks = 0;
+  if (cb->recovering == TCP_RECOVERY_FAST) {
+    if (SEQ_GEQ(cb->snd.una, cb->recover)) {
+      // full ack. deflate window and leave fast recovery
+      cb->cc.cwnd = MIN(cb->cc.ssthresh,
+                        MAX(cb->txq.snt, cb->cc.mss) + cb->cc.mss);
+      cb->recovering = TCP_RECOVERY_NONE;
+    } else if (!cb->sack_ok && cb->txq.head) {
+      // partial ack. retransmit the next hole and deflate window by acked
+      // https://tools.ietf.org/html/rfc6582#section-3.2
+#ifdef TCP_DEBUG
+      fprintf(stderr, ">>> partial ack : retransmit <<<\n");
+#endif
+      tcp_txq_xmit(cb, cb->txq.head, now);
+      cb->cc.cwnd -= MIN(acked, cb->cc.cwnd - cb->cc.mss);
+      if (acked >= cb->cc.mss) {
+        cb->cc.cwnd += cb->cc.mss;
+      }
+    }
+    // with SACK, holes are retransmitted by tcp_loss_recovery
+  } else if (acked && cb->cc.ops) {
+    if (cb->recovering == TCP_RECOVERY_LOSS &&
+        SEQ_GEQ(cb->snd.una, cb->recover)) {
+      cb->recovering = TCP_RECOVERY_NONE;
+    }
+    cb->cc.ops->on_ack(&cb->cc, acked, cb->srtt,
+                       (uint64_t)now->tv_sec * 1000000 + now->tv_usec);
+  }
+  if (cb->txq.head) {
+    tcp_timer_set(&cb->rexmt_timer, cb->rto);
+  } else {
+    tcp_timer_cancel(&cb->rexmt_timer);
+  }
+}
+
+// duplicate ack for outstanding data
+// https://tools.ietf.org/html/rfc5681#section-3.2
+static void tcp_txq_dupack(struct tcp_cb *cb, struct timeval *now) {
+  struct tcp_txq_entry *txq;
+
+  cb->dupacks++;
+  if (cb->sack_ok) {
+    // counted for tcp_loss_recovery
+    return;
+  }
+  if (cb->recovering == TCP_RECOVERY_LOSS) {
+    // going back N after timeout. duplicates of segments peer already has
+    // are expected
+    return;
+  }
+  if (cb->recovering) {
+    // inflate window by the segment which has left the network
+    cb->cc.cwnd += cb->cc.mss;
+    tcp_txq_output(cb, now);
+    return;
+  }
+  txq = cb->txq.head;
+  // don't enter fast recovery again for losses before the last recovery
+  if (cb->dupacks != TCP_DUPACK_THRESH ||
+      SEQ_LEQ(cb->snd.una, cb->recover) ||
+      !txq || !cb->cc.ops) {
+    return;
+  }
+#ifdef TCP_DEBUG
+  fprintf(stderr, ">>> fast retransmit <<<\n");
+#endif
+  cb->recover = cb->snd.nxt;
+  cb->recovering = TCP_RECOVERY_FAST;
+  cb->cc.ops->on_loss(&cb->cc, cb->txq.snt,
+                      (uint64_t)now->tv_sec * 1000000 + now->tv_usec);
+  tcp_txq_xmit(cb, txq, now);
+  cb->cc.cwnd = cb->cc.ssthresh + TCP_DUPACK_THRESH * cb->cc.mss;
+  tcp_timer_set(&cb->rexmt_timer, cb->rto);
+}
+
+/*
+ * SACK
+ */
+
+// mark segments which have enough SACKed segments above them as lost.
+// the marks only grow as SACK information arrives, so the examination goes on
+// from where it stopped. it never passes the tail, which has nothing above
+// https://tools.ietf.org/html/rfc6675#section-4 (IsLost)
+static void tcp_sack_lost(struct tcp_cb *cb) {
+  struct tcp_txq_entry *txq;
+  uint32_t segs, bytes;
+
+  txq = cb->txq.lost ? cb->txq.lost : cb->txq.head;
+  for (; txq; txq = txq->next) {
+    // SACKed above the segment
+    segs = cb->txq.sacked - cb->txq.lost_sacked - txq->sacked;
+    bytes = cb->txq.sacked_bytes - cb->txq.lost_sacked_bytes -
+            (txq->sacked ? txq->len : 0);
+    if (segs < TCP_DUPACK_THRESH &&
+        bytes <= (TCP_DUPACK_THRESH - 1) * cb->cc.mss) {
+      break;
+    }
+    if (txq->sacked) {
+      cb->txq.lost_sacked++;
+      cb->txq.lost_sacked_bytes += txq->len;
+    } else if (!txq->lost) {
+      cb->txq.pipe -= tcp_txq_pipe(txq);
+      txq->lost = 1;
+      cb->txq.pipe += tcp_txq_pipe(txq);
+    }
+  }
+  cb->txq.lost = txq;
+}
+
+static void tcp_sack_set(struct tcp_cb *cb, struct tcp_txq_entry *txq) {
+  cb->txq.pipe -= tcp_txq_pipe(txq);
+  txq->sacked = 1;
+  cb->txq.sacked++;
+  cb->txq.sacked_bytes += txq->len;
+  if (cb->txq.lost && SEQ_LT(txq->seq, cb->txq.lost->seq)) {
+    cb->txq.lost_sacked++;
+    cb->txq.lost_sacked_bytes += txq->len;
+  }
+}
+
+// mark sent segments covered by SACK blocks of received ack. peer repeats
+// its blocks on every ack and a block mostly grows at its right edge, so the
+// part marked by the previous ack is skipped
+static void tcp_sack_mark(struct tcp_cb *cb, struct tcp_opts *opts) {
+  struct tcp_txq_entry *txq;
+  struct tcp_sack_block blk[TCP_SACK_BLOCK_MAX];
+  uint32_t start, end, from;
+  int i, j, num = 0;
+
+  for (i = 0; i < opts->sack_num; i++) {
+    start = opts->sack[i].start;
+    end = opts->sack[i].end;
+    // ignore blocks which are stale or not sent yet
+    if (SEQ_GEQ(start, end) || SEQ_LEQ(end, cb->snd.una) ||
+        SEQ_GT(end, cb->snd.nxt)) {
+      continue;
+    }
+    from = start;
+    for (j = 0; j < cb->txq.blk_num; j++) {
+      if (SEQ_LEQ(cb->txq.blk[j].start, from) &&
+          SEQ_LT(from, cb->txq.blk[j].end)) {
+        from = cb->txq.blk[j].end;
+      }
+    }
+    blk[num++] = opts->sack[i];
+    if (SEQ_GEQ(from, end)) {
+      continue;
+    }
+    txq = cb->txq.mark;
+    if (!txq || SEQ_GT(txq->seq, from)) {
+      txq = cb->txq.head;
+    }
+    for (; txq && SEQ_LT(txq->seq, end); txq = txq->next) {
+      cb->txq.mark = txq;
+      if (!txq->sacked && SEQ_LEQ(start, txq->seq) &&
+          SEQ_LEQ(txq->seq + TCP_TXQ_SEG_LEN(txq), end) &&
+          SEQ_GT(txq->seq + TCP_TXQ_SEG_LEN(txq), from)) {
+        tcp_sack_set(cb, txq);
+      }
+    }
+  }
+  memcpy(cb->txq.blk, blk, num * sizeof(blk[0]));
+  cb->txq.blk_num = num;
+  tcp_sack_lost(cb);
+}
+
+// returns the first lost segment which is not retransmitted yet. holes are
+// retransmitted in order, so the search goes on from the last one
+static struct tcp_txq_entry *tcp_sack_hole(struct tcp_cb *cb) {
+  struct tcp_txq_entry *txq;
+
+  txq = cb->txq.hole ? cb->txq.hole : cb->txq.head;
+  for (; txq; txq = txq->next) {
+    cb->txq.hole = txq;
+    if (!txq->sacked && !txq->retrans) {
+      // lost segments come before the rest of unSACKed ones
+      return txq->lost ? txq : NULL;
+    }
+  }
+  return NULL;
+}
+
+// rebuild the scoreboard when a recovery starts. retransmissions of the last
+// recovery are forgotten, and after RTO everything not SACKed is lost
+static void tcp_sack_reset(struct tcp_cb *cb, int lost) {
+  struct tcp_txq_entry *txq;
+
+  cb->txq.pipe = 0;
+  for (txq = cb->txq.head; txq; txq = txq->next) {
+    txq->retrans = 0;
+    if (lost) {
+      txq->lost = !txq->sacked;
+    }
+    cb->txq.pipe += tcp_txq_pipe(txq);
+  }
+  cb->txq.hole = cb->txq.lost = NULL;
+  cb->txq.lost_sacked = cb->txq.lost_sacked_bytes = 0;
+  tcp_sack_lost(cb);
+}
+
+// retransmit a lost segment in loss recovery
+static void tcp_sack_rexmit(struct tcp_cb *cb, struct tcp_txq_entry *txq,
+                            struct timeval *now) {
+  cb->txq.pipe -= tcp_txq_pipe(txq);
+  tcp_txq_xmit(cb, txq, now);
+  txq->lost = txq->retrans = 1;
+  cb->txq.pipe += tcp_txq_pipe(txq);
+}
+
+// loss recovery with SACK, and after timeout without it. holes are
+// retransmitted first and new data is sent while pipe is under cwnd. without
+// SACK everything outstanding at the timeout is a hole, so it goes back N
+// with the window growing from one segment again.
+// returns 0 if normal output should be done.
+// https://tools.ietf.org/html/rfc6675#section-5
+static int tcp_loss_recovery(struct tcp_cb *cb, struct timeval *now) {
+  struct tcp_txq_entry *txq, *hole;
+  int sent = 0;
+
+  if (!cb->cc.ops ||
+      (!cb->sack_ok && cb->recovering != TCP_RECOVERY_LOSS)) {
+    return 0;
+  }
+  if (cb->recovering == TCP_RECOVERY_NONE) {
+    txq = cb->txq.head;
+    if (!txq || (cb->dupacks < TCP_DUPACK_THRESH && !txq->lost)) {
+      return 0;
+    }
+#ifdef TCP_DEBUG
+    fprintf(stderr, ">>> fast retransmit (sack) <<<\n");
+#endif
+    cb->recover = cb->snd.nxt;
+    cb->recovering = TCP_RECOVERY_FAST;
+    tcp_sack_reset(cb, 0);
+    cb->cc.ops->on_loss(&cb->cc, cb->txq.snt,
+                        (uint64_t)now->tv_sec * 1000000 + now->tv_usec);
+    // the segment at snd.una is retransmitted regardless of pipe
+    tcp_sack_rexmit(cb, txq, now);
+    sent = 1;
+  }
+  while (cb->txq.pipe + cb->cc.mss <= cb->cc.cwnd) {
+    if ((hole = tcp_sack_hole(cb))) {
+      tcp_sack_rexmit(cb, hole, now);
+    } else if (!tcp_txq_send_new(cb, cb->snd.wnd, now)) {
+      // no hole to fill, and no new data allowed by peer's window
+      break;
+    }
+    sent = 1;
+  }
+  if (sent && !tcp_timer_armed(&cb->rexmt_timer)) {
+    tcp_timer_set(&cb->rexmt_timer, cb->rto);
+  }
+  return 1;
+}
+
+/*
+ * Receive Buffer
+ */
+
+// put the range to the head of SACK blocks. blocks overlapped by it were
+// merged into it
+static void tcp_sack_update(struct tcp_cb *cb, uint32_t start, uint32_t end) {
+  int i, num = 0;
+
+  for (i = 0; i < cb->sack_num; i++) {
+    if (SEQ_LT(cb->sack[i].end, start) || SEQ_LT(end, cb->sack[i].start)) {
+      cb->sack[num++] = cb->sack[i];
+    }
+  }
+  if (num == TCP_SACK_BLOCK_MAX) {
+    // the oldest block is not reported any more
+    num--;
+  }
+  memmove(&cb->sack[1], &cb->sack[0], num * sizeof(cb->sack[0]));
+  cb->sack[0].start = start;
+  cb->sack[0].end = end;
+  cb->sack_num = num + 1;
+}
+
+// keep in-window segment beyond rcv.nxt at its place in receive buffer.
+// the range is merged with overlapping and adjacent ones in the sorted list.
+// segments after a hole mostly arrive in order, so the search starts from the
+// range extended last if the segment is not before it.
+static void tcp_ooo_add(struct tcp_cb *cb, uint32_t seq, uint8_t *data,
+                        size_t len) {
+  struct tcp_ooo_range **pprev, *range = NULL, *last, *next;
+  uint32_t off, start, end;
+
+  off = seq - cb->rcv.nxt;
+  if (off >= cb->rcv.wnd) {
+    return;
+  }
+  // trim the part beyond receive window
+  len = MIN(len, cb->rcv.wnd - off);
+  start = seq;
+  end = seq + len;
+
+  pprev = &cb->ooo;
+  if ((last = cb->ooo_last) && SEQ_LEQ(last->start, start)) {
+    if (SEQ_LEQ(start, last->end)) {
+      range = last;
+    } else {
+      pprev = &last->next;
+    }
+  }
+  if (!range) {
+    // find the first range which is not before the segment
+    for (; *pprev && SEQ_LT((*pprev)->end, start); pprev = &(*pprev)->next)
+      ;
+    range = *pprev;
+    if (!range || SEQ_LT(end, range->start)) {
+      if (cb->ooo_num >= TCP_OOO_RANGE_MAX) {
+        // too scattered. peer will retransmit it
+        return;
+      }
+      range = malloc(sizeof(struct tcp_ooo_range));
+      if (!range) {
+        // data is not recorded. peer will retransmit it
+        return;
+      }
+      range->start = start;
+      range->end = start;
+      range->next = *pprev;
+      *pprev = range;
+      cb->ooo_num++;
+    }
+  }
+  ring_write(&cb->rcvbuf, seq, data, len);
+  if (SEQ_LT(start, range->start)) {
+    range->start = start;
+  }
+  if (SEQ_GT(end, range->end)) {
+    range->end = end;
+  }
+  // absorb following ranges reached by the segment
+  while ((next = range->next) && SEQ_LEQ(next->start, range->end)) {
+    if (SEQ_GT(next->end, range->end)) {
+      range->end = next->end;
+    }
+    range->next = next->next;
+    free(next);
+    cb->ooo_num--;
+  }
+  cb->ooo_last = range;
+  tcp_sack_update(cb, range->start, range->end);
+}
+
+// rcv.nxt has been advanced. take in out-of-order data which became in order
+static void tcp_ooo_deliver(struct tcp_cb *cb) {
+  struct tcp_ooo_range *range;
+  uint32_t len;
+  int i, num = 0;
+
+  while ((range = cb->ooo) && SEQ_LEQ(range->start, cb->rcv.nxt)) {
+    if (SEQ_GT(range->end, cb->rcv.nxt)) {
+      len = range->end - cb->rcv.nxt;
+      cb->rcv.nxt += len;
+      cb->rcv.wnd -= len;
+    }
+    cb->ooo = range->next;
+    if (cb->ooo_last == range) {
+      cb->ooo_last = NULL;
+    }
+    free(range);
+    cb->ooo_num--;
+  }
+  for (i = 0; i < cb->sack_num; i++) {
+    if (SEQ_GT(cb->sack[i].start, cb->rcv.nxt)) {
+      cb->sack[num++] = cb->sack[i];
+    }
+  }
+  cb->sack_num = num;
+}
+
+static void tcp_ooo_clear(struct tcp_cb *cb) {
+  struct tcp_ooo_range *range;
+
+  while ((range = cb->ooo)) {
+    cb->ooo = range->next;
+    free(range);
+  }
+  cb->ooo_last = NULL;
+  cb->ooo_num = 0;
+  cb->sack_num = 0;
+}
+
+/*
+ * CONNECTION TABLE
+ */
+
+static uint32_t tcp_hash(ip_addr_t addr, uint16_t port, ip_addr_t peer_addr,
+                         uint16_t peer_port, int bits) {
+  uint32_t key;
+
+  key = (peer_addr ^ (addr * 0x9e3779b1)) +
+        ((uint32_t)port << 16 | peer_port);
+  // multiplicative hashing (golden ratio)
+  return (key * 0x9e3779b1) >> (32 - bits);
+}
+
+static ip_addr_t tcp_cb_addr(struct tcp_cb *cb) {
+  return cb->iface ? ((struct netif_ip *)cb->iface)->unicast : IP_ADDR_ANY;
+}
+
+static void tcp_cb_hash_add(struct tcp_cb **bucket, struct tcp_cb *cb) {
+  cb->hash_next = *bucket;
+  if (cb->hash_next) {
+    cb->hash_next->hash_pprev = &cb->hash_next;
+  }
+  *bucket = cb;
+  cb->hash_pprev = bucket;
+}
+
+// followings must be called with table_mutex
+
+static void tcp_cb_unhash(struct tcp_cb *cb) {
+  if (cb->hashed == TCP_CB_HASH_NONE) {
+    return;
+  }
+  *cb->hash_pprev = cb->hash_next;
+  if (cb->hash_next) {
+    cb->hash_next->hash_pprev = cb->hash_pprev;
+  }
+  cb->hash_next = NULL;
+  cb->hash_pprev = NULL;
+  if (cb->hashed == TCP_CB_HASH_CONN) {
+    conn_num--;
+  }
+  cb->hashed = TCP_CB_HASH_NONE;
+}
+
+// resize connection table to 2^bits buckets
+static int tcp_conn_rehash(int bits) {
+  struct tcp_cb **table, *cb, *next;
+  uint32_t idx;
+  size_t i;
+
+  table = calloc((size_t)1 << bits, sizeof(*table));
+  if (!table) {
+    return -1;
+  }
+  if (conn_table) {
+    for (i = 0; i < ((size_t)1 << conn_hash_bits); i++) {
+      for (cb = conn_table[i]; cb; cb = next) {
+        next = cb->hash_next;
+        idx = tcp_hash(tcp_cb_addr(cb), cb->port, cb->peer.addr,
+                       cb->peer.port, bits);
+        tcp_cb_hash_add(&table[idx], cb);
+      }
+    }
+    free(conn_table);
+  }
+  conn_table = table;
+  conn_hash_bits = bits;
+  return 0;
+}
+
+static struct tcp_cb *tcp_conn_lookup(struct netif *iface, uint16_t port,
+                                      ip_addr_t peer_addr,
+                                      uint16_t peer_port) {
+  struct tcp_cb *cb;
+  uint32_t idx;
+
+  idx = tcp_hash(((struct netif_ip *)iface)->unicast, port, peer_addr,
+                 peer_port, conn_hash_bits);
+  for (cb = conn_table[idx]; cb; cb = cb->hash_next) {
+    if (cb->iface == iface && cb->port == port &&
+        cb->peer.addr == peer_addr && cb->peer.port == peer_port) {
+      return cb;
+    }
+  }
+  return NULL;
+}
+
+static int tcp_conn_hash(struct tcp_cb *cb) {
+  uint32_t idx;
+
+  if (tcp_conn_lookup(cb->iface, cb->port, cb->peer.addr, cb->peer.port)) {
+    // connection is already exists
+    return -1;
+  }
+  if (conn_num >= ((size_t)1 << conn_hash_bits) &&
+      conn_hash_bits < TCP_CONN_HASH_BITS_MAX) {
+    // keep load factor under 1. table is used as is on failure
+    tcp_conn_rehash(conn_hash_bits + 1);
+  }
+  idx = tcp_hash(tcp_cb_addr(cb), cb->port, cb->peer.addr, cb->peer.port,
+                 conn_hash_bits);
+  tcp_cb_hash_add(&conn_table[idx], cb);
+  cb->hashed = TCP_CB_HASH_CONN;
+  conn_num++;
+  return 0;
+}
+
+// listener bound to the address is preferred to the one bound to any address
+static struct tcp_cb *tcp_listen_lookup(ip_addr_t addr, uint16_t port) {
+  struct tcp_cb *cb;
+  uint32_t idx;
 
-  tcp_state_dump(cb);
-  fprintf(stderr, " len: %lu\n", plen);
-  fprintf(stderr, " src: %u\n", ntoh16(hdr->src));
-  fprintf(stderr, " dst: %u\n", ntoh16(hdr->dst));
-  fprintf(stderr, " seq: %u\n", ntoh32(hdr->seq));
-  fprintf(stderr, " ack: %u\n", ntoh32(hdr->ack));
-  fprintf(stderr, " off: %u\n", hdr->off);
-  fprintf(stderr, " flg: [%s]\n", tcp_flg_ntop(hdr->flg, buf, 64));
-  fprintf(stderr, " win: %u\n", ntoh16(hdr->win));
-  fprintf(stderr, " sum: %u\n", ntoh16(hdr->sum));
-  fprintf(stderr, " urg: %u\n", ntoh16(hdr->urg));
+  idx = tcp_hash(addr, port, 0, 0, TCP_LISTEN_HASH_BITS);
+  for (cb = listen_table[idx]; cb; cb = cb->hash_next) {
+    if (tcp_cb_addr(cb) == addr && cb->port == port) {
+      return cb;
+    }
+  }
+  if (addr != IP_ADDR_ANY) {
+    return tcp_listen_lookup(IP_ADDR_ANY, port);
+  }
+  return NULL;
 }
 
-static uint16_t tcp_checksum(ip_addr_t self, ip_addr_t peer, uint8_t *segment,
-                             size_t len) {
-  uint32_t pseudo = 0;
+static void tcp_listen_hash(struct tcp_cb *cb) {
+  uint32_t idx;
 
-  pseudo += (self >> 16) & 0xffff;
-  pseudo += self & 0xffff;
-  pseudo += (peer >> 16) & 0xffff;
-  pseudo += self & 0xffff;
-  pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
-  pseudo += hton16(len);
-  return cksum16((uint16_t *)segment, len, pseudo);
+  idx = tcp_hash(tcp_cb_addr(cb), cb->port, 0, 0, TCP_LISTEN_HASH_BITS);
+  tcp_cb_hash_add(&listen_table[idx], cb);
+  cb->hashed = TCP_CB_HASH_LISTEN;
 }
 
-/*
- * Segment Queue
- */
+// port is network byte order
+static void tcp_cb_set_port(struct tcp_cb *cb, uint16_t port) {
+  if (cb->port) {
+    port_refs[ntoh16(cb->port)]--;
+  }
+  cb->port = port;
+  if (port) {
+    port_refs[ntoh16(port)]++;
+  }
+}
 
-static struct tcp_txq_entry *tcp_txq_add(struct tcp_cb *cb, struct tcp_hdr *hdr,
-                                         size_t len) {
-  struct tcp_txq_entry *txq;
+// add a chunk of cbs to the free list
+static int tcp_cb_grow(void) {
+  struct tcp_cb *chunk;
+  int i;
 
-  txq = malloc(sizeof(struct tcp_txq_entry));
-  if (!txq) {
-    return NULL;
+  if (cb_chunk_num >= TCP_CB_CHUNK_MAX) {
+    return -1;
   }
-  txq->segment = hdr;
-  txq->len = len;
-  // clear timestamp
-  memset(&txq->timestamp, 0, sizeof(txq->timestamp));
-  txq->next = NULL;
-  // set txq to next of tail entry
-  if (cb->txq.head == NULL) {
-    cb->txq.head = txq;
-  } else {
-    cb->txq.tail->next = txq;
+  chunk = calloc(TCP_CB_CHUNK_SIZE, sizeof(struct tcp_cb));
+  if (!chunk) {
+    return -1;
   }
-  // update tail entry
-  cb->txq.tail = txq;
+  for (i = TCP_CB_CHUNK_SIZE - 1; i >= 0; i--) {
+    chunk[i].id = cb_chunk_num * TCP_CB_CHUNK_SIZE + i;
+    chunk[i].rto = TCP_RTO_INIT;
+    chunk[i].delack_timeout = TCP_DELACK_TIMEOUT;
+    pthread_mutex_init(&chunk[i].mutex, NULL);
+    pthread_cond_init(&chunk[i].cond, NULL);
+    timer_setup(&chunk[i].rexmt_timer.timer, tcp_rexmt_timeout, &chunk[i]);
+    timer_setup(&chunk[i].user_timer.timer, tcp_user_timeout, &chunk[i]);
+    timer_setup(&chunk[i].timewait_timer.timer, tcp_timewait_timeout, &chunk[i]);
+    timer_setup(&chunk[i].delack_timer.timer, tcp_delack_timeout, &chunk[i]);
+    timer_setup(&chunk[i].persist_timer.timer, tcp_persist_timeout, &chunk[i]);
+    chunk[i].hash_next = free_list;
+    free_list = &chunk[i];
+  }
+  cb_chunks[cb_chunk_num] = chunk;
+  // publish the chunk after initialized for tcp_cb_get without lock
+  __atomic_store_n(&cb_chunk_num, cb_chunk_num + 1, __ATOMIC_RELEASE);
+  return 0;
+}
 
-  return txq;
+// returns cb of socket descriptor, or NULL if soc is invalid
+static struct tcp_cb *tcp_cb_get(int soc) {
+  if (soc < 0 ||
+      soc >= __atomic_load_n(&cb_chunk_num, __ATOMIC_ACQUIRE) *
+                 TCP_CB_CHUNK_SIZE) {
+    return NULL;
+  }
+  return &cb_chunks[soc / TCP_CB_CHUNK_SIZE][soc % TCP_CB_CHUNK_SIZE];
 }
 
-static void tcp_txq_clear_all(struct tcp_cb *cb) {
-  struct tcp_txq_entry *txq = cb->txq.head, *next;
-  while (txq) {
-    next = txq->next;
-    free(txq->segment);
-    free(txq);
-    txq = next;
+static struct tcp_cb *tcp_cb_alloc(void) {
+  struct tcp_cb *cb;
+
+  if (!free_list && tcp_cb_grow() == -1) {
+    return NULL;
   }
-  cb->txq.head = cb->txq.tail = NULL;
+  cb = free_list;
+  free_list = cb->hash_next;
+  cb->hash_next = NULL;
+  return cb;
+}
+
+// return cb to the free list. cb must be unused and closed, and called with
+// cb mutex. new owner takes cb mutex before initializing it.
+static void tcp_cb_release(struct tcp_cb *cb) {
+  pthread_mutex_lock(&table_mutex);
+  tcp_cb_unhash(cb);
+  tcp_cb_set_port(cb, 0);
+  cb->iface = NULL;
+  cb->peer.addr = IP_ADDR_ANY;
+  cb->peer.port = 0;
+  cb->parent = NULL;
+  cb->cc.ops = NULL;
+  cb->delack_timeout = TCP_DELACK_TIMEOUT;
+  cb->nodelay = cb->cork = 0;
+  cb->nonblock = cb->connecting = 0;
+  cb->hash_next = free_list;
+  free_list = cb;
+  pthread_mutex_unlock(&table_mutex);
 }
 
 /*
@@ -270,19 +1696,233 @@ static void tcp_close_cb(struct tcp_cb *cb) {
   cb->iss = 0;
   memset(&cb->rcv, 0, sizeof(cb->rcv));
   cb->irs = 0;
+  cb->mss = 0;
+  cb->srtt = cb->rttvar = 0;
+  cb->rto = TCP_RTO_INIT;
+  cb->dupacks = cb->recovering = 0;
+  cb->sack_ok = 0;
+  cb->ts_ok = 0;
+  cb->ts_recent = cb->last_ack_sent = 0;
+  cb->delack_bytes = cb->quickack = 0;
+  tcp_timer_stop(&cb->rexmt_timer);
+  tcp_timer_stop(&cb->user_timer);
+  tcp_timer_stop(&cb->timewait_timer);
+  tcp_timer_stop(&cb->delack_timer);
+  tcp_timer_stop(&cb->persist_timer);
   tcp_txq_clear_all(cb);
+  tcp_zc_complete(cb, -1);
+  tcp_buf_put(&snd_buf_pool, &cb->sndbuf);
+  tcp_ooo_clear(cb);
+  if (!cb->lent) {
+    // otherwise kept until user releases it
+    tcp_buf_put(&rcv_buf_pool, &cb->rcvbuf);
+  }
+  if (!cb->used && !cb->backlogged) {
+    tcp_cb_release(cb);
+  } else {
+    pthread_mutex_lock(&table_mutex);
+    tcp_cb_unhash(cb);
+    pthread_mutex_unlock(&table_mutex);
+  }
   return;
 }
 
+// must be called with cb mutex. takes mutex of listener after that.
+static int tcp_backlog_push(struct tcp_cb *cb) {
+  struct tcp_cb *parent;
+  int ret = -1;
+
+  parent = cb->parent;
+  pthread_mutex_lock(&parent->mutex);
+  // listener may be closed and its cb may be reused
+  if (parent->state == TCP_CB_STATE_LISTEN && parent->port == cb->port) {
+    if (queue_push(&parent->backlog, cb, sizeof(*cb)) == 0) {
+      cb->backlogged = 1;
+      pthread_cond_signal(&parent->cond);
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&parent->mutex);
+  return ret;
+}
+
+// must be called with cb mutex, not with table_mutex. copies options of
+// listener, which tcp_api_setopt changes under its mutex
+static void tcp_cb_inherit(struct tcp_cb *cb) {
+  struct tcp_cb *parent;
+
+  parent = cb->parent;
+  pthread_mutex_lock(&parent->mutex);
+  // listener may be closed and its cb may be reused
+  if (parent->state == TCP_CB_STATE_LISTEN && parent->port == cb->port) {
+    cb->cc.ops = parent->cc.ops;
+    cb->delack_timeout = parent->delack_timeout;
+    cb->nodelay = parent->nodelay;
+    cb->cork = parent->cork;
+    cb->nonblock = parent->nonblock;
+  }
+  pthread_mutex_unlock(&parent->mutex);
+}
+
+/*
+ * Timers
+ */
+
+static void tcp_rexmt_timeout(void *arg) {
+  struct tcp_cb *cb;
+  struct tcp_txq_entry *txq;
+  struct timeval now;
+
+  cb = (struct tcp_cb *)arg;
+  pthread_mutex_lock(&cb->mutex);
+  if (!tcp_timer_expired(&cb->rexmt_timer) ||
+      cb->state == TCP_CB_STATE_CLOSED) {
+    pthread_mutex_unlock(&cb->mutex);
+    return;
+  }
+  txq = cb->txq.head;
+  if (!txq) {
+    // nothing is outstanding
+    pthread_mutex_unlock(&cb->mutex);
+    return;
+  }
+  gettimeofday(&now, NULL);
+  // back off the timer and retransmit the earliest unacknowledged segment
+  // https://tools.ietf.org/html/rfc6298#section-5
+  cb->rto = MIN(cb->rto * 2, TCP_RTO_MAX);
+  cb->dupacks = 0;
+  cb->recover = cb->snd.nxt;
+  // everything outstanding but SACKed is presumed lost. the rest of holes
+  // are retransmitted by tcp_loss_recovery as cwnd grows again, so each of
+  // them doesn't cost another timeout
+  cb->recovering = TCP_RECOVERY_LOSS;
+  tcp_sack_reset(cb, 1);
+  if (!txq->rexmt && cb->cc.ops) {
+    // further timeouts of the same segment don't reduce ssthresh again
+    cb->cc.ops->on_rto(&cb->cc, cb->txq.snt,
+                       (uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+  }
+#ifdef TCP_DEBUG
+  fprintf(stderr, ">>> find retransmission timeout (rto %u) <<<\n", cb->rto);
+#endif
+  tcp_sack_rexmit(cb, txq, &now);
+  tcp_timer_set(&cb->rexmt_timer, cb->rto);
+  pthread_mutex_unlock(&cb->mutex);
+}
+
+static void tcp_user_timeout(void *arg) {
+  struct tcp_cb *cb;
+
+  cb = (struct tcp_cb *)arg;
+  pthread_mutex_lock(&cb->mutex);
+  if (tcp_timer_expired(&cb->user_timer) &&
+      cb->state != TCP_CB_STATE_CLOSED && cb->snd.una != cb->snd.nxt) {
+    // force close connection because of ack timeout
+#ifdef TCP_DEBUG
+    fprintf(stderr, ">>> find user timeout <<<\n");
+    tcp_state_dump(cb);
+#endif
+    tcp_close_cb(cb);
+    pthread_cond_broadcast(&cb->cond);
+  }
+  pthread_mutex_unlock(&cb->mutex);
+  tcp_zc_notify();
+}
+
+static void tcp_timewait_timeout(void *arg) {
+  struct tcp_cb *cb;
+
+  cb = (struct tcp_cb *)arg;
+  pthread_mutex_lock(&cb->mutex);
+  if (tcp_timer_expired(&cb->timewait_timer) &&
+      cb->state == TCP_CB_STATE_TIME_WAIT) {
+    tcp_close_cb(cb);
+    pthread_cond_broadcast(&cb->cond);
+  }
+  pthread_mutex_unlock(&cb->mutex);
+}
+
+// enter TIME_WAIT and start time-wait timer
+static void tcp_timewait_start(struct tcp_cb *cb) {
+  cb->state = TCP_CB_STATE_TIME_WAIT;
+  tcp_timer_stop(&cb->rexmt_timer);
+  tcp_timer_stop(&cb->user_timer);
+  tcp_timer_stop(&cb->delack_timer);
+  tcp_timer_stop(&cb->persist_timer);
+  tcp_timer_set(&cb->timewait_timer, TIME_WAIT_TIMEOUT * 1000000ULL);
+}
+
+// probe peer's zero window while data is waiting for it. the probe is an
+// ack below window (snd.una - 1) which peer answers with its current window.
+// it takes no sequence space, so probing goes on with backoff as long as
+// the window is closed, without user timeout
+// https://tools.ietf.org/html/rfc1122#page-92
+static void tcp_persist_timeout(void *arg) {
+  struct tcp_cb *cb;
+  struct timeval now;
+
+  cb = (struct tcp_cb *)arg;
+  pthread_mutex_lock(&cb->mutex);
+  if (tcp_timer_expired(&cb->persist_timer) &&
+      cb->state != TCP_CB_STATE_CLOSED && !cb->txq.head &&
+      tcp_snd_unsent(cb) && !cb->snd.wnd) {
+    gettimeofday(&now, NULL);
+#ifdef TCP_DEBUG
+    fprintf(stderr, ">>> zero window probe (interval %u) <<<\n", cb->persist);
+#endif
+    tcp_tx(cb, cb->snd.una - 1, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
+    cb->persist = MIN(cb->persist * 2, TCP_RTO_MAX);
+    tcp_timer_set(&cb->persist_timer, cb->persist);
+  }
+  pthread_mutex_unlock(&cb->mutex);
+}
+
+// send ack if it has not been piggybacked on data meanwhile
+static void tcp_delack_timeout(void *arg) {
+  struct tcp_cb *cb;
+  struct timeval now;
+
+  cb = (struct tcp_cb *)arg;
+  pthread_mutex_lock(&cb->mutex);
+  if (tcp_timer_expired(&cb->delack_timer) &&
+      cb->state != TCP_CB_STATE_CLOSED && cb->last_ack_sent != cb->rcv.nxt) {
+    gettimeofday(&now, NULL);
+    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
+  }
+  pthread_mutex_unlock(&cb->mutex);
+}
+
+// in-order data has been received. ack every second full-sized segment at
+// once and delay others, so that the ack may ride on reply data
+// https://tools.ietf.org/html/rfc5681#section-4.2
+static void tcp_delack(struct tcp_cb *cb, size_t len, struct timeval *now) {
+  cb->delack_bytes += len;
+  if (cb->quickack || !cb->delack_timeout ||
+      cb->delack_bytes >= 2 * tcp_cb_mss(cb)) {
+    if (cb->quickack) {
+      cb->quickack--;
+    }
+    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, now, 0);
+    return;
+  }
+  if (!tcp_timer_armed(&cb->delack_timer)) {
+    tcp_timer_set(&cb->delack_timer, cb->delack_timeout);
+  }
+}
+
 // SEGMENT ARRIVES
 // https://tools.ietf.org/html/rfc793#page-65
 static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
                                       size_t len) {
   size_t plen;
-  int acceptable = 0;
+  int acceptable = 0, acked;
   struct timeval now;
+  struct tcp_opts opts;
+  uint32_t seq;
+  uint8_t *data;
 
   plen = TCP_DATA_LEN(hdr, len);
+  tcp_opts_parse(hdr, &opts);
   if (gettimeofday(&now, NULL) == -1) {
     perror("gettimeofday");
     return;
@@ -292,10 +1932,11 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
     case TCP_CB_STATE_CLOSED:
       if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
         if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-          tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, &now, NULL, 0);
+          tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, &now, 0);
         } else {
-          tcp_tx(cb, 0, ntoh32(hdr->seq) + plen, TCP_FLG_RST | TCP_FLG_ACK,
-                 &now, NULL, 0);
+          // SYN and FIN occupy sequence space
+          tcp_tx(cb, 0, ntoh32(hdr->seq) + TCP_SEG_LEN(hdr, len),
+                 TCP_FLG_RST | TCP_FLG_ACK, &now, 0);
         }
       }
       return;
@@ -309,7 +1950,7 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
 
       // second check for an ACK
       if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-        tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, &now, NULL, 0);
+        tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, &now, 0);
         goto ERROR_RX_LISTEN;
       }
 
@@ -320,15 +1961,28 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
         // TODO: If the SEG.PRC is greater than the TCB.PRC
 
         // else
-        cb->rcv.wnd = sizeof(cb->window);
+        cb->rcv.wnd = TCP_RCV_BUF_SIZE;
         cb->rcv.nxt = ntoh32(hdr->seq) + 1;
         cb->irs = ntoh32(hdr->seq);
         cb->iss = (uint32_t)random();
-        tcp_tx(cb, cb->iss, cb->rcv.nxt, TCP_FLG_SYN | TCP_FLG_ACK, &now, NULL,
-               0);
-        cb->snd.nxt = cb->iss + 1;
+        // window of SYN is never scaled. wl1 and wl2 must be set before the
+        // window check of the handshake ack, which compares them modulo 2^32
+        cb->snd.wnd = ntoh16(hdr->win);
+        cb->snd.wl1 = ntoh32(hdr->seq);
+        cb->snd.wl2 = cb->iss;
+        tcp_mss_set(cb, &opts);
+        tcp_wscale_set(cb, &opts);
+        tcp_ts_set(cb, &opts, &now);
+        cb->sack_ok = opts.sack_permitted;
+        tcp_cc_init(&cb->cc, tcp_cb_mss(cb));
+        // ack at once while sender is in slow start
+        cb->quickack = TCP_QUICKACK_SEGS;
+        cb->rcv.rd = cb->rcv.nxt;
+        tcp_txq_syn(cb, TCP_FLG_SYN | TCP_FLG_ACK, &now);
+        cb->snd.nxt = cb->snd.end = cb->iss + 1;
         cb->snd.una = cb->iss;
-        cb->timeout = now.tv_sec + USER_TIMEOUT;
+        cb->recover = cb->iss;
+        tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
         cb->state = TCP_CB_STATE_SYN_RCVD;
 
         // TODO: ?  queue to backlog ?
@@ -347,12 +2001,13 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
     case TCP_CB_STATE_SYN_SENT:
       // first check the ACK bit
       if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-        if (ntoh32(hdr->ack) <= cb->iss || ntoh32(hdr->ack) > cb->snd.nxt) {
-          tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, &now, NULL, 0);
+        if (SEQ_LEQ(ntoh32(hdr->ack), cb->iss) ||
+            SEQ_GT(ntoh32(hdr->ack), cb->snd.nxt)) {
+          tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, &now, 0);
           return;
         }
-        if (cb->snd.una <= ntoh32(hdr->ack) &&
-            ntoh32(hdr->ack) <= cb->snd.nxt) {
+        if (SEQ_LEQ(cb->snd.una, ntoh32(hdr->ack)) &&
+            SEQ_LEQ(ntoh32(hdr->ack), cb->snd.nxt)) {
           acceptable = 1;
         } else {
           // drop invalid ack
@@ -377,21 +2032,32 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
       // fourth check the SYN bit
       if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
         cb->rcv.nxt = ntoh32(hdr->seq) + 1;
+        cb->rcv.rd = cb->rcv.nxt;
         cb->irs = ntoh32(hdr->seq);
+        // our SYN always offers window scale, timestamps and SACK
+        tcp_mss_set(cb, &opts);
+        tcp_wscale_set(cb, &opts);
+        tcp_ts_set(cb, &opts, &now);
+        cb->sack_ok = opts.sack_permitted;
+        // restart congestion control with negotiated segment size
+        tcp_cc_init(&cb->cc, tcp_cb_mss(cb));
+        cb->quickack = TCP_QUICKACK_SEGS;
+        cb->snd.wnd = ntoh16(hdr->win);
+        cb->snd.wl1 = ntoh32(hdr->seq);
+        cb->snd.wl2 = ntoh32(hdr->ack);
         // TODO: ? if there is an ACK ?
-        if (cb->snd.una < ntoh32(hdr->ack)) {
+        if (SEQ_LT(cb->snd.una, ntoh32(hdr->ack))) {
           // update snd.una and user timeout
           cb->snd.una = ntoh32(hdr->ack);
-          cb->timeout = now.tv_sec + USER_TIMEOUT;
-          pthread_cond_signal(&timer_cond);
+          tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
+          // clear acked SYN from retransmission queue
+          tcp_txq_acked(cb, &opts, &now);
         }
 
-        // TODO: clear all retransmission queue
-
-        if (cb->snd.una > cb->iss) {
+        if (SEQ_GT(cb->snd.una, cb->iss)) {
           // our SYN has been ACKed
           cb->state = TCP_CB_STATE_ESTABLISHED;
-          tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, NULL, 0);
+          tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
           pthread_cond_signal(&cb->cond);
           if (plen > 0 || TCP_FLG_ISSET(hdr->flg, TCP_FLG_URG)) {
             goto CHECK_URG;
@@ -399,8 +2065,7 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
           return;
         } else {
           cb->state = TCP_CB_STATE_SYN_RCVD;
-          tcp_tx(cb, cb->iss, cb->rcv.nxt, TCP_FLG_SYN | TCP_FLG_ACK, &now,
-                 NULL, 0);
+          tcp_txq_syn(cb, TCP_FLG_SYN | TCP_FLG_ACK, &now);
           pthread_cond_signal(&cb->cond);
           // TODO: If there are other controls or text in the segment, queue
           // them for processing after the ESTABLISHED state has been reached,
@@ -432,20 +2097,37 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
       return;
   }
 
+  // PAWS: segment with older timestamp is an old duplicate. ts_recent is
+  // not trusted after the connection has been idle for a long time
+  // https://tools.ietf.org/html/rfc7323#section-5.3
+  if (cb->ts_ok && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+    if (!opts.ts_ok) {
+      // drop silently
+      return;
+    }
+    if ((int32_t)(opts.tsval - cb->ts_recent) < 0 &&
+        now.tv_sec - cb->ts_recent_age <= TCP_PAWS_IDLE) {
+      tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
+      return;
+    }
+  }
+
   // first check sequence number
   if (plen > 0) {
     if (cb->rcv.wnd > 0) {
-      acceptable = (cb->rcv.nxt <= ntoh32(hdr->seq) &&
-                    ntoh32(hdr->seq) < cb->rcv.nxt + cb->rcv.wnd) ||
-                   (cb->rcv.nxt <= ntoh32(hdr->seq) &&
-                    ntoh32(hdr->seq) + plen - 1 < cb->rcv.nxt + cb->rcv.wnd);
+      // either the first or the last byte is in window
+      acceptable =
+          (SEQ_LEQ(cb->rcv.nxt, ntoh32(hdr->seq)) &&
+           SEQ_LT(ntoh32(hdr->seq), cb->rcv.nxt + cb->rcv.wnd)) ||
+          (SEQ_LEQ(cb->rcv.nxt, ntoh32(hdr->seq) + plen - 1) &&
+           SEQ_LT(ntoh32(hdr->seq) + plen - 1, cb->rcv.nxt + cb->rcv.wnd));
     } else {
       acceptable = 0;
     }
   } else {
     if (cb->rcv.wnd > 0) {
-      acceptable = (cb->rcv.nxt <= ntoh32(hdr->seq) &&
-                    ntoh32(hdr->seq) < cb->rcv.nxt + cb->rcv.wnd);
+      acceptable = (SEQ_LEQ(cb->rcv.nxt, ntoh32(hdr->seq)) &&
+                    SEQ_LT(ntoh32(hdr->seq), cb->rcv.nxt + cb->rcv.wnd));
     } else {
       acceptable = ntoh32(hdr->seq) == cb->rcv.nxt;
     }
@@ -454,12 +2136,21 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
   if (!acceptable) {
     if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
       fprintf(stderr, "is not acceptable !!!\n");
-      tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, NULL, 0);
+      tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
     }
     // drop segment
     return;
   }
 
+  // remember timestamp to be echoed
+  // https://tools.ietf.org/html/rfc7323#section-4.3
+  if (cb->ts_ok && opts.ts_ok &&
+      (int32_t)(opts.tsval - cb->ts_recent) >= 0 &&
+      SEQ_LEQ(ntoh32(hdr->seq), cb->last_ack_sent)) {
+    cb->ts_recent = opts.tsval;
+    cb->ts_recent_age = now.tv_sec;
+  }
+
   // second check the RST bit
   switch (cb->state) {
     case TCP_CB_STATE_SYN_RCVD:
@@ -504,7 +2195,7 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
 
   // fourth, check the SYN bit
   if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
-    tcp_tx(cb, 0, cb->rcv.nxt, TCP_FLG_RST, &now, NULL, 0);
+    tcp_tx(cb, 0, cb->rcv.nxt, TCP_FLG_RST, &now, 0);
     tcp_close_cb(cb);
     pthread_cond_broadcast(&cb->cond);
     return;
@@ -516,18 +2207,22 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
   if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
     switch (cb->state) {
       case TCP_CB_STATE_SYN_RCVD:
-        if (!(cb->snd.una <= ntoh32(hdr->ack) &&
-              ntoh32(hdr->ack) <= cb->snd.nxt)) {
+        if (!(SEQ_LEQ(cb->snd.una, ntoh32(hdr->ack)) &&
+              SEQ_LEQ(ntoh32(hdr->ack), cb->snd.nxt))) {
           // hdr->ack is not acceptable
-          tcp_tx(cb, ntoh32(hdr->ack), cb->rcv.nxt, TCP_FLG_RST, &now, NULL, 0);
+          tcp_tx(cb, ntoh32(hdr->ack), cb->rcv.nxt, TCP_FLG_RST, &now, 0);
           // The connection remains in the same state after send RST
           break;
         }
         cb->state = TCP_CB_STATE_ESTABLISHED;
         if (cb->parent) {
           // add cb to backlog
-          queue_push(&cb->parent->backlog, cb, sizeof(*cb));
-          pthread_cond_signal(&cb->parent->cond);
+          if (tcp_backlog_push(cb) == -1) {
+            // listener is closed
+            tcp_tx(cb, cb->snd.nxt, 0, TCP_FLG_RST, &now, 0);
+            tcp_close_cb(cb);
+            return;
+          }
         } else {
           // parent == NULL means cb is created by user and first state was
           // SYN_SENT
@@ -540,27 +2235,49 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
       case TCP_CB_STATE_FIN_WAIT2:
       case TCP_CB_STATE_CLOSE_WAIT:
       case TCP_CB_STATE_CLOSING:
-        if (cb->snd.una <= ntoh32(hdr->ack) &&
-            ntoh32(hdr->ack) <= cb->snd.nxt) {
-          if (cb->snd.una < ntoh32(hdr->ack)) {
+        if (SEQ_LEQ(cb->snd.una, ntoh32(hdr->ack)) &&
+            SEQ_LEQ(ntoh32(hdr->ack), cb->snd.nxt)) {
+          if (cb->sack_ok) {
+            tcp_sack_mark(cb, &opts);
+          }
+          acked = SEQ_LT(cb->snd.una, ntoh32(hdr->ack));
+          if (acked) {
             // update snd.una and user timeout
             cb->snd.una = ntoh32(hdr->ack);
-            cb->timeout = now.tv_sec + USER_TIMEOUT;
-            pthread_cond_signal(&timer_cond);
+            tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
+            tcp_txq_acked(cb, &opts, &now);
+          } else if (plen == 0 && cb->snd.una != cb->snd.nxt &&
+                     !TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN | TCP_FLG_FIN) &&
+                     ((uint32_t)ntoh16(hdr->win) << cb->snd.wscale) ==
+                         cb->snd.wnd) {
+            tcp_txq_dupack(cb, &now);
           }
-          // TODO: retransmission queue send
-          pthread_cond_broadcast(&cb->cond);
 
-          if ((cb->snd.wl1 < ntoh32(hdr->seq)) ||
+          if (SEQ_LT(cb->snd.wl1, ntoh32(hdr->seq)) ||
               (cb->snd.wl1 == ntoh32(hdr->seq) &&
-               cb->snd.wl2 <= ntoh32(hdr->ack))) {
-            cb->snd.wnd = ntoh16(hdr->win);
+               SEQ_LEQ(cb->snd.wl2, ntoh32(hdr->ack)))) {
+            cb->snd.wnd = (uint32_t)ntoh16(hdr->win) << cb->snd.wscale;
             cb->snd.wl1 = ntoh32(hdr->seq);
             cb->snd.wl2 = ntoh32(hdr->ack);
           }
-        } else if (ntoh32(hdr->ack) > cb->snd.nxt) {
+          // peer answering with closed window is alive. data held back by
+          // it doesn't time out (RFC 1122 4.2.2.17)
+          if (!cb->snd.wnd && cb->snd.una != cb->snd.nxt) {
+            tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
+          }
+          // the ack clocks out retransmissions of holes and new segments
+          // allowed by the window at once
+          if (!tcp_loss_recovery(cb, &now)) {
+            tcp_txq_output(cb, &now);
+          }
+          // wake sender blocked on full send buffer when a good part of it
+          // is free, rather than on every ack
+          if (acked && tcp_snd_space(cb) >= TCP_SND_LOWAT) {
+            pthread_cond_broadcast(&cb->cond);
+          }
+        } else if (SEQ_GT(ntoh32(hdr->ack), cb->snd.nxt)) {
           fprintf(stderr, "recv ack but ack is advanced to snd.nxt\n");
-          tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, NULL, 0);
+          tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
           // drop the segment
           return;
         }
@@ -568,7 +2285,7 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
 
         if (cb->state == TCP_CB_STATE_FIN_WAIT1) {
           // if this ACK is for sent FIN
-          if (ntoh32(hdr->ack) + 1 == cb->snd.nxt) {
+          if (tcp_fin_acked(cb, ntoh32(hdr->ack))) {
             cb->state = TCP_CB_STATE_FIN_WAIT2;
           }
         } else if (cb->state == TCP_CB_STATE_FIN_WAIT2) {
@@ -576,8 +2293,8 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
           // acknowledged ("ok")
         } else if (cb->state == TCP_CB_STATE_CLOSING) {
           // if this ACK is for sent FIN
-          if (ntoh32(hdr->ack) + 1 == cb->snd.nxt) {
-            cb->state = TCP_CB_STATE_TIME_WAIT;
+          if (tcp_fin_acked(cb, ntoh32(hdr->ack))) {
+            tcp_timewait_start(cb);
           }
         }
 
@@ -585,7 +2302,7 @@ static void tcp_event_segment_arrives(struct tcp_cb *cb, struct tcp_hdr *hdr,
 
       case TCP_CB_STATE_LAST_ACK:
         // if this ACK is for sent FIN
-        if (ntoh32(hdr->ack) == cb->snd.nxt) {
+        if (tcp_fin_acked(cb, ntoh32(hdr->ack))) {
           tcp_close_cb(cb);
           pthread_cond_broadcast(&cb->cond);
           return;
@@ -638,17 +2355,46 @@ CHECK_URG:
     case TCP_CB_STATE_ESTABLISHED:
     case TCP_CB_STATE_FIN_WAIT1:
     case TCP_CB_STATE_FIN_WAIT2:
-      // TODO: accept not ordered packet
-      if (plen > 0 && cb->rcv.nxt == ntoh32(hdr->seq)) {
+      seq = ntoh32(hdr->seq);
+      data = (uint8_t *)hdr + TCP_HDR_LEN(hdr);
+      if (plen > 0 && SEQ_LT(seq, cb->rcv.nxt)) {
+        // trim the part already received
+        data += cb->rcv.nxt - seq;
+        plen -= cb->rcv.nxt - seq;
+        seq = cb->rcv.nxt;
+      }
+      if (plen > 0 && cb->rcv.nxt == seq) {
+        if (tcp_buf_get(&rcv_buf_pool, &cb->rcvbuf) == -1) {
+          // drop segment. peer will retransmit it
+          return;
+        }
+        // don't overrun receive buffer
+        plen = MIN(plen, cb->rcv.wnd);
         // copy segment to receive buffer
-        memcpy(cb->window + (sizeof(cb->window) - cb->rcv.wnd),
-               (uint8_t *)hdr + TCP_HDR_LEN(hdr), plen);
-        cb->rcv.nxt = ntoh32(hdr->seq) + plen;
+        ring_write(&cb->rcvbuf, seq, data, plen);
+        cb->rcv.nxt = seq + plen;
         cb->rcv.wnd -= plen;
-        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, NULL, 0);
+        if (cb->ooo) {
+          // the gap may be filled. ack at once to finish sender's recovery
+          tcp_ooo_deliver(cb);
+          tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
+        } else {
+          tcp_delack(cb, plen, &now);
+        }
         pthread_cond_broadcast(&cb->cond);
+      } else if (plen > 0) {
+        // out of order. keep it and send duplicate ack immediately, so that
+        // sender notices the hole
+        // https://tools.ietf.org/html/rfc5681#section-4.2
+        if (tcp_buf_get(&rcv_buf_pool, &cb->rcvbuf) == -1) {
+          return;
+        }
+        tcp_ooo_add(cb, seq, data, plen);
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
+        // sender is recovering from loss and needs acks soon
+        cb->quickack = TCP_QUICKACK_SEGS;
       } else if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_PSH)) {
-        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, NULL, 0);
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
         pthread_cond_broadcast(&cb->cond);
       }
       break;
@@ -670,10 +2416,13 @@ CHECK_URG:
       break;
   }
 
-  // eighth, check the FIN bit
-  if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
-    cb->rcv.nxt = ntoh32(hdr->seq) + 1;
-    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, NULL, 0);
+  // eighth, check the FIN bit. FIN follows the data of the segment, and is
+  // processed only when all data before it has been received
+  if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN) &&
+      ntoh32(hdr->seq) + TCP_DATA_LEN(hdr, len) == cb->rcv.nxt) {
+    cb->rcv.nxt++;
+    cb->rcv.fin = 1;
+    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, &now, 0);
     switch (cb->state) {
       case TCP_CB_STATE_SYN_RCVD:
       case TCP_CB_STATE_ESTABLISHED:
@@ -685,10 +2434,7 @@ CHECK_URG:
         break;
 
       case TCP_CB_STATE_FIN_WAIT2:
-        cb->state = TCP_CB_STATE_TIME_WAIT;
-        // start time-wait timer
-        cb->timeout = now.tv_sec + TIME_WAIT_TIMEOUT;
-        // TODO: turn off other timers
+        tcp_timewait_start(cb);
         break;
 
       case TCP_CB_STATE_CLOSING:
@@ -700,7 +2446,7 @@ CHECK_URG:
       case TCP_CB_STATE_TIME_WAIT:
         // remain state
         // restart the 2MSL timeout
-        cb->timeout = now.tv_sec + TIME_WAIT_TIMEOUT;
+        tcp_timer_set(&cb->timewait_timer, TIME_WAIT_TIMEOUT * 1000000ULL);
         break;
 
       default:
@@ -718,69 +2464,51 @@ CHECK_URG:
  * TCP APPLICATION CONTROLLER
  */
 
-// TODO: where to get current time.
+// build a segment and send it. len bytes of data are taken from send buffer
+// at seq. segments which occupy sequence space are queued by caller
 static ssize_t tcp_tx(struct tcp_cb *cb, uint32_t seq, uint32_t ack,
-                      uint8_t flg, struct timeval *now, uint8_t *buf,
-                      size_t len) {
-  uint8_t *segment;
+                      uint8_t flg, struct timeval *now, size_t len) {
+  uint8_t segment[IP_PAYLOAD_SIZE_MAX];
   struct tcp_hdr *hdr;
   ip_addr_t self, peer;
-  struct tcp_txq_entry *txq = NULL;
-  int have_unsent;
+  size_t hlen;
 
-  // allocate segment
-  segment = malloc(sizeof(struct tcp_hdr) + len);
-  if (!segment) {
+  hlen = sizeof(struct tcp_hdr) +
+         tcp_opts_build(cb, flg, len, now, segment + sizeof(struct tcp_hdr));
+  if (hlen + len > sizeof(segment)) {
     return -1;
   }
 
   // set header params
   hdr = (struct tcp_hdr *)segment;
-  memset(hdr, 0, sizeof(struct tcp_hdr));
   hdr->src = cb->port;
   hdr->dst = cb->peer.port;
   hdr->seq = hton32(seq);
   hdr->ack = hton32(ack);
-  hdr->off = (sizeof(struct tcp_hdr) >> 2) << 4;
+  hdr->off = (hlen >> 2) << 4;
   hdr->flg = flg;
-  hdr->win = hton16(cb->rcv.wnd);
+  hdr->win = hton16(tcp_cb_adv_wnd(cb, flg));
   hdr->sum = 0;
   hdr->urg = 0;
 
   // copy data
-  memcpy(hdr + 1, buf, len);
-
-  if (len > 0 || flg & (TCP_FLG_SYN | TCP_FLG_FIN)) {
-    // add txq list only packets which have ack reply
-
-    // check unsent segment exists in cb->txq
-    have_unsent = cb->txq.tail && cb->txq.tail->timestamp.tv_sec == 0;
-
-    // add txq
-    txq = tcp_txq_add(cb, hdr, sizeof(struct tcp_hdr) + len);
-    if (!txq) {
-      free(segment);
-      return -1;
-    }
+  if (len > 0) {
+    tcp_snd_read(cb, seq, segment + hlen, len);
+  }
 
-    // flow control
-    // TODO: cb->txq.snt is not exactly the sliding window size
-    if (have_unsent || (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN) &&
-                        cb->txq.snt + len > cb->snd.wnd)) {
-      // before established snd.wnd is 0. so SYN does not care snd.wnd
-      // segment is stored in txq and send later in timer_thread
-      fprintf(stderr, ">>> not send havesent %d %d<<<\n", have_unsent,
-              cb->txq.tail);
-      tcp_dump(cb, hdr, len);
-      return 0;
-    }
+  if (TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+    // pending delayed ack is piggybacked
+    cb->last_ack_sent = ack;
+    cb->delack_bytes = 0;
+    cb->rcv.adv = ack + ((uint32_t)ntoh16(hdr->win)
+                         << (TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? 0
+                                                             : cb->rcv.wscale));
   }
 
   // calculate checksum
   self = ((struct netif_ip *)cb->iface)->unicast;
   peer = cb->peer.addr;
-  hdr->sum =
-      tcp_checksum(self, peer, (uint8_t *)hdr, sizeof(struct tcp_hdr) + len);
+  hdr->sum = tcp_checksum(self, peer, segment, hlen + len);
 
 #ifdef TCP_DEBUG
   fprintf(stderr, ">>> tcp_tx <<<\n");
@@ -788,33 +2516,18 @@ static ssize_t tcp_tx(struct tcp_cb *cb, uint32_t seq, uint32_t ack,
 #endif
 
   // send packet
-  if (ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)hdr,
-            sizeof(struct tcp_hdr) + len, &peer) == -1) {
+  if (ip_tx(cb->iface, IP_PROTOCOL_TCP, segment, hlen + len, &peer) == -1) {
     // failed to send ip packet
-    if (!txq) {
-      // this packet does not expect reply so not queued into txq list
-      free(segment);
-    }
     return -1;
   }
-
-  if (txq) {
-    // set timestamp
-    txq->timestamp = *now;
-    cb->txq.snt += len;
-  } else {
-    // this packet does not expect reply so not queued into txq list
-    free(segment);
-  }
-
   return len;
 }
 
 static void tcp_rx(uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst,
                    struct netif *iface) {
   struct tcp_hdr *hdr;
-  int i;
-  struct tcp_cb *cb, *fcb = NULL, *lcb = NULL;
+  struct tcp_cb *cb, *lcb = NULL;
+  int reply_only = 0;
 
   // validate tcp packet
   if (*dst != ((struct netif_ip *)iface)->unicast) {
@@ -824,210 +2537,93 @@ static void tcp_rx(uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst,
     return;
   }
 
-  // validate checksum
-  hdr = (struct tcp_hdr *)segment;
-  if (tcp_checksum(*src, *dst, segment, len) != 0) {
-    fprintf(stderr, "tcp checksum error\n");
-    return;
-  }
-
-  pthread_mutex_lock(&mutex);
-
-  // find connection cb or listener cb
-  for (i = 0; i < TCP_CB_TABLE_SIZE; i++) {
-    cb = &cb_table[i];
-    if (IS_FREE_CB(cb)) {
-      // cache cb for the case SYN message and no cb is connected to this peer
-      if (fcb == NULL) {
-        fcb = cb;
-      }
-    } else if ((!cb->iface || cb->iface == iface) && cb->port == hdr->dst) {
-      // if ip address and dst port number matches
-      if (cb->peer.addr == *src && cb->peer.port == hdr->src) {
-        // this cb is connection for this tcp packet
-        break;
-      } else if (cb->state == TCP_CB_STATE_LISTEN && !lcb) {
-        // listener socket is found
-        lcb = cb;
-      }
-    }
-  }
-
-  // cb that matches this tcp packet is not found.
-  // create socket if listener socket exists and packet is SYN packet.
-  if (i == TCP_CB_TABLE_SIZE) {
-    if (!fcb) {
-      // cb resource is run out
-      // TODO: send RST
-      pthread_mutex_unlock(&mutex);
-      return;
-    }
-
-    // create accept socket
-    cb = fcb;
-    cb->iface = iface;
-    if (lcb) {
-      // TODO: ? if SYN is not set ?
-      cb->state = lcb->state;
-      cb->port = lcb->port;
-      cb->parent = lcb;
-    } else {
-      // this port is not listened.
-      // this packet is invalid. no connection is found.
-      cb->port = 0;
-    }
-    cb->peer.addr = *src;
-    cb->peer.port = hdr->src;
-  }
-  // else cb that matches this tcp packet is found.
-
-#ifdef TCP_DEBUG
-  fprintf(stderr, ">>> tcp_rx <<<\n");
-  tcp_dump(cb, hdr, TCP_DATA_LEN(hdr, len));
-#endif
-
-  // handle message
-  tcp_event_segment_arrives(cb, hdr, len);
-  pthread_mutex_unlock(&mutex);
-  return;
-}
-
-static void *tcp_timer_thread(void *arg) {
-  struct timeval timestamp, diff;
-  struct timespec timeout;
-  struct tcp_cb *cb;
-  struct tcp_txq_entry *txq, *prev, *tmp;
-  ip_addr_t self, peer;
-  size_t sum = 0;
-  int i;
-
-  diff.tv_sec = 0;
-  diff.tv_usec = 100 * 1000;
-
-  pthread_mutex_lock(&mutex);
-  while (1) {
-    gettimeofday(&timestamp, NULL);
-    for (i = 0; i < TCP_CB_TABLE_SIZE; i++) {
-      cb = &cb_table[i];
-
-      if (cb->state == TCP_CB_STATE_CLOSED) {
-        // skip check timeout
-        continue;
-      }
-
-      // check user timeout
-      if ((cb->snd.una != cb->snd.nxt || cb->state == TCP_CB_STATE_TIME_WAIT) &&
-          cb->timeout < timestamp.tv_sec) {
-        // force close connection because of ack timeout or TIME_WAIT timeout
-
-#ifdef TCP_DEBUG
-        fprintf(stderr, ">>> find user timeout (%ld - %ld) <<<\n",
-                timestamp.tv_sec, cb->timeout);
-        tcp_state_dump(cb);
-#endif
-        tcp_close_cb(cb);
-        pthread_cond_broadcast(&cb->cond);
-        continue;
-      }
-
-      // check retransmission timeout and vacuum acked segment entry
-      prev = NULL;
-      txq = cb->txq.head;
-      sum = 0;
-      if (cb->txq.head) {
-        self = ((struct netif_ip *)cb->iface)->unicast;
-        peer = cb->peer.addr;
-      }
-      while (txq) {
-        if (ntoh32(txq->segment->seq) >= cb->snd.una) {
-          // TODO: check sum + datalen should compare with snd.wnd. but
-          // txq->segment does not support splitting. so sum add later
-          /* sum += TCP_DATA_LEN(txq->segment, txq->len); */
-
-          if (sum < cb->snd.wnd) {
-            // this txq is in sliding send window
-
-            if (txq->timestamp.tv_sec == 0) {
-              // this txq is not sent
-
-              // re-calc checksum
-              txq->segment->ack = hton32(cb->rcv.nxt);
-              txq->segment->sum = 0;
-              txq->segment->sum =
-                  tcp_checksum(self, peer, txq->segment, txq->len);
-
-#ifdef TCP_DEBUG
-              fprintf(stderr, ">>> tcp_tx in timer_thread <<<\n");
-              tcp_dump(cb, txq->segment, TCP_DATA_LEN(txq->segment, txq->len));
-#endif
-
-              // send packet
-              ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)txq->segment,
-                    txq->len, &cb->peer.addr);
-              txq->timestamp = timestamp;
-            } else if (timestamp.tv_sec - txq->timestamp.tv_sec > 3) {
-              // if retransmission timeout (3 seconds) then resend
-
-              // re-calc checksum
-              txq->segment->ack = hton32(cb->rcv.nxt);
-              txq->segment->sum = 0;
-              txq->segment->sum =
-                  tcp_checksum(self, peer, txq->segment, txq->len);
-
-#ifdef TCP_DEBUG
-              fprintf(stderr,
-                      ">>> find retransmission timeout (%ld - %ld) <<<\n",
-                      timestamp.tv_sec, txq->timestamp.tv_sec);
-              tcp_dump(cb, txq->segment, TCP_DATA_LEN(txq->segment, txq->len));
-#endif
-
-              // resend packet
-              ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)txq->segment,
-                    txq->len, &cb->peer.addr);
-              txq->timestamp = timestamp;
-            }
-          }
+  hdr = (struct tcp_hdr *)segment;
+  if ((size_t)TCP_HDR_LEN(hdr) < sizeof(struct tcp_hdr) ||
+      (size_t)TCP_HDR_LEN(hdr) > len) {
+    return;
+  }
 
-          // FIXME: temporary sum add here. no support splitting
-          sum += TCP_DATA_LEN(txq->segment, txq->len);
+  // validate checksum
+  if (tcp_checksum(*src, *dst, segment, len) != 0) {
+    fprintf(stderr, "tcp checksum error\n");
+    return;
+  }
 
-          // update previous tcp_txq_entry
-          prev = txq;
-          txq = txq->next;
-        } else {
-          // remove tcp_txq_entry from list
-          cb->txq.snt -= TCP_DATA_LEN(txq->segment, txq->len);
+  // find connection cb. cb is locked after releasing table_mutex, so check
+  // that it is not closed or reused meanwhile.
+  while (1) {
+    pthread_mutex_lock(&table_mutex);
+    cb = tcp_conn_lookup(iface, hdr->dst, *src, hdr->src);
+    if (!cb) {
+      // keep table_mutex
+      break;
+    }
+    pthread_mutex_unlock(&table_mutex);
+    pthread_mutex_lock(&cb->mutex);
+    if (cb->hashed == TCP_CB_HASH_CONN && cb->iface == iface &&
+        cb->port == hdr->dst && cb->peer.addr == *src &&
+        cb->peer.port == hdr->src) {
+      break;
+    }
+    pthread_mutex_unlock(&cb->mutex);
+  }
 
-          // swap tail tcp_txq_entry
-          if (!txq->next) {
-            // txq is tail entry
-            cb->txq.tail = prev;
-          }
-          // swap previous tcp_txq_entry
-          if (prev) {
-            prev->next = txq->next;
-          } else {
-            cb->txq.head = txq->next;
-          }
+  // cb that matches this tcp packet is not found.
+  // create socket if listener socket exists and packet is SYN packet.
+  if (!cb) {
+    lcb = tcp_listen_lookup(*dst, hdr->dst);
+    cb = tcp_cb_alloc();
+    pthread_mutex_unlock(&table_mutex);
+    if (!cb) {
+      // cb resource is run out
+      // TODO: send RST
+      return;
+    }
 
-          // free tcp_txq_entry
-          tmp = txq->next;
-          free(txq->segment);
-          free(txq);
-          // check next entry
-          txq = tmp;
-        }
+    // create accept socket
+    pthread_mutex_lock(&cb->mutex);
+    cb->iface = iface;
+    cb->peer.addr = *src;
+    cb->peer.port = hdr->src;
+    pthread_mutex_lock(&table_mutex);
+    tcp_cb_set_port(cb, hdr->dst);
+    if (lcb) {
+      // TODO: ? if SYN is not set ?
+      cb->state = TCP_CB_STATE_LISTEN;
+      cb->parent = lcb;
+      if (tcp_conn_hash(cb) == -1) {
+        // created by another thread meanwhile. drop segment
+        pthread_mutex_unlock(&table_mutex);
+        cb->state = TCP_CB_STATE_CLOSED;
+        tcp_cb_release(cb);
+        pthread_mutex_unlock(&cb->mutex);
+        return;
       }
+    } else {
+      // this port is not listened. this packet is invalid.
+      // cb is used only to reply RST in CLOSED state.
+      reply_only = 1;
+    }
+    pthread_mutex_unlock(&table_mutex);
+    if (lcb) {
+      tcp_cb_inherit(cb);
     }
-    // sleep 100 ms
-    timeradd(&timestamp, &diff, &timestamp);
-    timeout.tv_sec = timestamp.tv_sec;
-    timeout.tv_nsec = timestamp.tv_usec * 1000;
-    pthread_cond_timedwait(&timer_cond, &mutex, &timeout);
   }
-  pthread_mutex_unlock(&mutex);
+  // else cb that matches this tcp packet is found.
 
-  return NULL;
+#ifdef TCP_DEBUG
+  fprintf(stderr, ">>> tcp_rx <<<\n");
+  tcp_dump(cb, hdr, TCP_DATA_LEN(hdr, len));
+#endif
+
+  // handle message
+  tcp_event_segment_arrives(cb, hdr, len);
+  if (reply_only) {
+    tcp_cb_release(cb);
+  }
+  pthread_mutex_unlock(&cb->mutex);
+  tcp_zc_notify();
+  return;
 }
 
 /*
@@ -1036,25 +2632,22 @@ static void *tcp_timer_thread(void *arg) {
 
 int tcp_api_open(void) {
   struct tcp_cb *cb;
-  int i;
 
-  pthread_mutex_lock(&mutex);
-  for (i = 0; i < TCP_CB_TABLE_SIZE; i++) {
-    cb = &cb_table[i];
-    if (IS_FREE_CB(cb)) {
-      cb->used = 1;
-      pthread_mutex_unlock(&mutex);
-      return i;
-    }
+  pthread_mutex_lock(&table_mutex);
+  cb = tcp_cb_alloc();
+  pthread_mutex_unlock(&table_mutex);
+  if (!cb) {
+    fprintf(stderr, "error:  insufficient resources\n");
+    return -1;
   }
-  pthread_mutex_unlock(&mutex);
-  fprintf(stderr, "error:  insufficient resources\n");
-  return -1;
+  pthread_mutex_lock(&cb->mutex);
+  cb->used = 1;
+  pthread_mutex_unlock(&cb->mutex);
+  return cb->id;
 }
 
+// must be called with cb mutex
 int tcp_close(struct tcp_cb *cb) {
-  struct tcp_cb *backlog = NULL;
-  size_t size;
   struct timeval now;
   if (!cb->used) {
     fprintf(stderr, "error:  connection illegal for this process\n");
@@ -1062,19 +2655,24 @@ int tcp_close(struct tcp_cb *cb) {
   }
 
   cb->used = 0;
+  // data lent by tcp_api_recv_zc is not used after the socket is closed
+  if (cb->lent) {
+    cb->lent = 0;
+    if (cb->state == TCP_CB_STATE_CLOSED) {
+      tcp_buf_put(&rcv_buf_pool, &cb->rcvbuf);
+    }
+  }
   if (gettimeofday(&now, NULL) == -1) {
     return -1;
   }
 
   switch (cb->state) {
     case TCP_CB_STATE_CLOSED:
+      tcp_cb_release(cb);
       break;
 
     case TCP_CB_STATE_LISTEN:
-      // close all cb in backlog
-      while (queue_pop(&cb->backlog, (void **)&backlog, &size) != -1) {
-        tcp_close(backlog);
-      }
+      // cbs in backlog are closed by caller
     case TCP_CB_STATE_SYN_SENT:
       // close socket
       tcp_close_cb(cb);
@@ -1083,20 +2681,16 @@ int tcp_close(struct tcp_cb *cb) {
 
     case TCP_CB_STATE_SYN_RCVD:
       // if send buffer is empty
-      tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, &now,
-             NULL, 0);
-      cb->snd.nxt++;
+      cb->snd.fin = 1;
+      tcp_txq_output(cb, &now);
       cb->state = TCP_CB_STATE_FIN_WAIT1;
       // TODO: else then wait change to ESTABLISHED state
       break;
 
     case TCP_CB_STATE_ESTABLISHED:
-      // if send buffer is empty
-      // TODO: else then wait send all data in send buffer
-      // TODO: ? linux tcp need ack with fin ?
-      tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, &now,
-             NULL, 0);
-      cb->snd.nxt++;
+      // FIN is sent after all data in send buffer
+      cb->snd.fin = 1;
+      tcp_txq_output(cb, &now);
       cb->state = TCP_CB_STATE_FIN_WAIT1;
       break;
 
@@ -1111,9 +2705,8 @@ int tcp_close(struct tcp_cb *cb) {
 
     case TCP_CB_STATE_CLOSE_WAIT:
       // wait send all data in send buffer
-      tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, &now,
-             NULL, 0);
-      cb->snd.nxt++;
+      cb->snd.fin = 1;
+      tcp_txq_output(cb, &now);
       cb->state = TCP_CB_STATE_CLOSING;
       break;
   }
@@ -1122,66 +2715,98 @@ int tcp_close(struct tcp_cb *cb) {
 }
 
 int tcp_api_close(int soc) {
+  struct tcp_cb *cb, *child;
+  struct queue_head backlog = {};
+  size_t size;
   int ret;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
-  ret = tcp_close(&cb_table[soc]);
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_lock(&cb->mutex);
+  if (cb->used && cb->state == TCP_CB_STATE_LISTEN) {
+    // take over backlog. children are locked after the listener is unlocked
+    backlog = cb->backlog;
+    memset(&cb->backlog, 0, sizeof(cb->backlog));
+  }
+  ret = tcp_close(cb);
+  pthread_mutex_unlock(&cb->mutex);
+
+  // close all cb in backlog as if they were accepted
+  while (queue_pop(&backlog, (void **)&child, &size) != -1) {
+    pthread_mutex_lock(&child->mutex);
+    child->backlogged = 0;
+    child->used = 1;
+    tcp_close(child);
+    pthread_mutex_unlock(&child->mutex);
+  }
+  tcp_zc_notify();
 
   return ret;
 }
 
 int tcp_api_connect(int soc, ip_addr_t *addr, uint16_t port) {
-  struct tcp_cb *cb, *tmp;
+  struct tcp_cb *cb;
   struct timeval now;
-  int i, j;
+  int i;
   int offset;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
-  cb = &cb_table[soc];
+  pthread_mutex_lock(&cb->mutex);
+  if (cb->used && cb->connecting) {
+    // report the result of non-blocking connect
+    if (cb->state == TCP_CB_STATE_SYN_SENT) {
+      errno = EALREADY;
+      pthread_mutex_unlock(&cb->mutex);
+      return -1;
+    }
+    cb->connecting = 0;
+    if (cb->state == TCP_CB_STATE_CLOSED) {
+      errno = ECONNREFUSED;
+      pthread_mutex_unlock(&cb->mutex);
+      return -1;
+    }
+    pthread_mutex_unlock(&cb->mutex);
+    return 0;
+  }
 
   // check cb state
   if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
 
   if (gettimeofday(&now, NULL) == -1) {
     perror("gettimeofday");
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
 
+  pthread_mutex_lock(&table_mutex);
   // if port number is not specified then generate nice port
   if (!cb->port) {
     offset = time(NULL) % 1024;
     // find port number which is not used between TCP_SOURCE_PORT_MIN and
     // TCP_SOURCE_PORT_MAX
     for (i = TCP_SOURCE_PORT_MIN + offset; i <= TCP_SOURCE_PORT_MAX; i++) {
-      for (j = 0; j < TCP_CB_TABLE_SIZE; j++) {
-        tmp = &cb_table[j];
-        if (!IS_FREE_CB(tmp) && tmp->port == hton16((uint16_t)i)) {
-          break;
-        }
-      }
-      if (j == TCP_CB_TABLE_SIZE) {
+      if (!port_refs[i]) {
         // port number (i) is not used
-        cb->port = hton16((uint16_t)i);
+        tcp_cb_set_port(cb, hton16((uint16_t)i));
         break;
       }
     }
     if (!cb->port) {
       // could not find unused port number
-      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&table_mutex);
+      pthread_mutex_unlock(&cb->mutex);
       return -1;
     }
   }
@@ -1191,63 +2816,99 @@ int tcp_api_connect(int soc, ip_addr_t *addr, uint16_t port) {
   cb->peer.port = hton16(port);
   cb->iface = ip_netif_by_peer(&cb->peer.addr);
   if (!cb->iface) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&table_mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
-  cb->rcv.wnd = sizeof(cb->window);
+  if (tcp_conn_hash(cb) == -1) {
+    fprintf(stderr, "error:  connection already exists\n");
+    cb->iface = NULL;
+    pthread_mutex_unlock(&table_mutex);
+    pthread_mutex_unlock(&cb->mutex);
+    return -1;
+  }
+  pthread_mutex_unlock(&table_mutex);
+  cb->rcv.wnd = TCP_RCV_BUF_SIZE;
+  tcp_cc_init(&cb->cc, tcp_cb_mss(cb));
   cb->iss = (uint32_t)random();
 
   // send SYN packet
-  if (tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, &now, NULL, 0) == -1) {
-    pthread_mutex_unlock(&mutex);
+  if (tcp_txq_syn(cb, TCP_FLG_SYN, &now) == -1) {
+    pthread_mutex_lock(&table_mutex);
+    tcp_cb_unhash(cb);
+    pthread_mutex_unlock(&table_mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
   cb->snd.una = cb->iss;
-  cb->snd.nxt = cb->iss + 1;
-  cb->timeout = now.tv_sec + USER_TIMEOUT;
+  cb->snd.nxt = cb->snd.end = cb->iss + 1;
+  cb->recover = cb->iss;
+  tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
   cb->state = TCP_CB_STATE_SYN_SENT;
+  if (cb->nonblock) {
+    // the result is taken by calling connect again
+    cb->connecting = 1;
+    errno = EINPROGRESS;
+    pthread_mutex_unlock(&cb->mutex);
+    return -1;
+  }
 
   // wait until state change
   while (cb->state == TCP_CB_STATE_SYN_SENT) {
-    pthread_cond_wait(&cb_table[soc].cond, &mutex);
+    if (cb->nonblock) {
+      // switched to non-blocking meanwhile. the result is taken by calling
+      // connect again
+      cb->connecting = 1;
+      errno = EINPROGRESS;
+      pthread_mutex_unlock(&cb->mutex);
+      return -1;
+    }
+    pthread_cond_wait(&cb->cond, &cb->mutex);
+  }
+  if (cb->state == TCP_CB_STATE_CLOSED) {
+    // reset or timed out
+    errno = ECONNREFUSED;
+    pthread_mutex_unlock(&cb->mutex);
+    return -1;
   }
 
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_unlock(&cb->mutex);
   return 0;
 }
 
 int tcp_api_bind(int soc, uint16_t port) {
   struct tcp_cb *cb;
-  int i;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
+  pthread_mutex_lock(&cb->mutex);
+  pthread_mutex_lock(&table_mutex);
 
   // check port is already used
-  for (i = 0; i < TCP_CB_TABLE_SIZE; i++) {
-    if (cb_table[i].port == hton16(port)) {
-      pthread_mutex_unlock(&mutex);
-      fprintf(stderr, "error:  port is already used\n");
-      return -1;
-    }
+  if (port_refs[port]) {
+    pthread_mutex_unlock(&table_mutex);
+    pthread_mutex_unlock(&cb->mutex);
+    fprintf(stderr, "error:  port is already used\n");
+    return -1;
   }
 
   // check cb is closed
-  cb = &cb_table[soc];
   if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&table_mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
 
   // TODO: bind ip address
 
   // set port number
-  cb->port = hton16(port);
-  pthread_mutex_unlock(&mutex);
+  tcp_cb_set_port(cb, hton16(port));
+  pthread_mutex_unlock(&table_mutex);
+  pthread_mutex_unlock(&cb->mutex);
   return 0;
 }
 
@@ -1255,18 +2916,21 @@ int tcp_api_listen(int soc) {
   struct tcp_cb *cb;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
-  cb = &cb_table[soc];
+  pthread_mutex_lock(&cb->mutex);
   if (!cb->used || cb->state != TCP_CB_STATE_CLOSED || !cb->port) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
   cb->state = TCP_CB_STATE_LISTEN;
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_lock(&table_mutex);
+  tcp_listen_hash(cb);
+  pthread_mutex_unlock(&table_mutex);
+  pthread_mutex_unlock(&cb->mutex);
   return 0;
 }
 
@@ -1275,47 +2939,55 @@ int tcp_api_accept(int soc) {
   size_t size;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
-  cb = &cb_table[soc];
+  pthread_mutex_lock(&cb->mutex);
   if (!cb->used || cb->state != TCP_CB_STATE_LISTEN) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
 
   while (cb->state == TCP_CB_STATE_LISTEN &&
          queue_pop(&cb->backlog, (void **)&backlog, &size) == -1) {
-    pthread_cond_wait(&cb->cond, &mutex);
+    if (cb->nonblock) {
+      errno = EAGAIN;
+      break;
+    }
+    pthread_cond_wait(&cb->cond, &cb->mutex);
   }
 
+  pthread_mutex_unlock(&cb->mutex);
   if (!backlog) {
-    pthread_mutex_unlock(&mutex);
     return -1;
   }
 
+  // backlog was popped, so nobody else hands out this cb
+  pthread_mutex_lock(&backlog->mutex);
+  backlog->backlogged = 0;
   backlog->used = 1;
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_unlock(&backlog->mutex);
 
-  return array_offset(cb_table, backlog);
+  return backlog->id;
 }
 
 ssize_t tcp_api_recv(int soc, uint8_t *buf, size_t size) {
   struct tcp_cb *cb;
+  struct timeval now;
   size_t total, len;
   char *err;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
-  cb = &cb_table[soc];
+  pthread_mutex_lock(&cb->mutex);
   if (!cb->used) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
 
@@ -1325,33 +2997,51 @@ TCP_RECEIVE_RETRY:
       err = "error:  connection illegal for this process\n";
       goto ERROR_RECEIVE;
 
-    case TCP_CB_STATE_LISTEN:
     case TCP_CB_STATE_SYN_SENT:
     case TCP_CB_STATE_SYN_RCVD:
+      if (cb->nonblock) {
+        // non-blocking connect is in progress
+        goto AGAIN_RECEIVE;
+      }
       // TODO: wait change to ESTABLISHED
       err = "error:  connection illegal for this process\n";
       goto ERROR_RECEIVE;
 
+    case TCP_CB_STATE_LISTEN:
+      err = "error:  connection illegal for this process\n";
+      goto ERROR_RECEIVE;
+
     case TCP_CB_STATE_CLOSE_WAIT:
     case TCP_CB_STATE_ESTABLISHED:
     case TCP_CB_STATE_FIN_WAIT1:
     case TCP_CB_STATE_FIN_WAIT2:
-      total = sizeof(cb->window) - cb->rcv.wnd;
+      if (cb->lent) {
+        err = "error:  receive buffer is lent\n";
+        goto ERROR_RECEIVE;
+      }
+      total = tcp_rcv_unread(cb);
       if (total == 0) {
         if (cb->state == TCP_CB_STATE_CLOSE_WAIT) {
           err = "error:  connection closing\n";
           goto ERROR_RECEIVE;
         }
 
+        if (cb->nonblock) {
+          goto AGAIN_RECEIVE;
+        }
         // wait and retry to read rcv buffer
-        pthread_cond_wait(&cb->cond, &mutex);
+        pthread_cond_wait(&cb->cond, &cb->mutex);
         goto TCP_RECEIVE_RETRY;
       }
       len = total > size ? size : total;
-      memcpy(buf, cb->window, len);
-      memmove(cb->window, cb->window + len, total - len);
-      cb->rcv.wnd += len;
-      pthread_mutex_unlock(&mutex);
+      ring_read(&cb->rcvbuf, cb->rcv.rd, buf, len);
+      cb->rcv.rd += len;
+      gettimeofday(&now, NULL);
+      tcp_rcv_wnd_open(cb, &now);
+      if (total == len && !cb->ooo) {
+        tcp_buf_put(&rcv_buf_pool, &cb->rcvbuf);
+      }
+      pthread_mutex_unlock(&cb->mutex);
       return len;
 
     case TCP_CB_STATE_CLOSING:
@@ -1361,32 +3051,149 @@ TCP_RECEIVE_RETRY:
       goto ERROR_RECEIVE;
 
     default:
-      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&cb->mutex);
       return -1;
   }
 
+AGAIN_RECEIVE:
+  pthread_mutex_unlock(&cb->mutex);
+  errno = EAGAIN;
+  return -1;
+
 ERROR_RECEIVE:
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_unlock(&cb->mutex);
+  fprintf(stderr, err);
+  return -1;
+}
+
+// lend data in receive buffer following the data lent before. it stays in
+// place until released, since the window never covers unread data
+ssize_t tcp_api_recv_zc(int soc, const uint8_t **data, size_t size) {
+  struct tcp_cb *cb;
+  size_t total, len;
+  char *err;
+
+  // validate soc id
+  cb = tcp_cb_get(soc);
+  if (!cb || !data) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cb->mutex);
+  if (!cb->used) {
+    pthread_mutex_unlock(&cb->mutex);
+    return -1;
+  }
+
+TCP_RECEIVE_ZC_RETRY:
+  switch (cb->state) {
+    case TCP_CB_STATE_CLOSE_WAIT:
+    case TCP_CB_STATE_ESTABLISHED:
+    case TCP_CB_STATE_FIN_WAIT1:
+    case TCP_CB_STATE_FIN_WAIT2:
+      total = tcp_rcv_unread(cb) - cb->lent;
+      if (total == 0) {
+        if (cb->state == TCP_CB_STATE_CLOSE_WAIT) {
+          err = "error:  connection closing\n";
+          goto ERROR_RECEIVE_ZC;
+        }
+
+        if (cb->nonblock) {
+          goto AGAIN_RECEIVE_ZC;
+        }
+        // wait and retry to lend rcv buffer
+        pthread_cond_wait(&cb->cond, &cb->mutex);
+        goto TCP_RECEIVE_ZC_RETRY;
+      }
+      // data wrapping around the ring is lent by the next call
+      len = MIN(total, size);
+      *data = ring_peek(&cb->rcvbuf, cb->rcv.rd + cb->lent, &len);
+      cb->lent += len;
+      pthread_mutex_unlock(&cb->mutex);
+      return len;
+
+    case TCP_CB_STATE_CLOSING:
+    case TCP_CB_STATE_TIME_WAIT:
+    case TCP_CB_STATE_LAST_ACK:
+      err = "error:  connection closing\n";
+      goto ERROR_RECEIVE_ZC;
+
+    case TCP_CB_STATE_SYN_SENT:
+    case TCP_CB_STATE_SYN_RCVD:
+      if (cb->nonblock) {
+        goto AGAIN_RECEIVE_ZC;
+      }
+      err = "error:  connection illegal for this process\n";
+      goto ERROR_RECEIVE_ZC;
+
+    default:
+      err = "error:  connection illegal for this process\n";
+      goto ERROR_RECEIVE_ZC;
+  }
+
+AGAIN_RECEIVE_ZC:
+  pthread_mutex_unlock(&cb->mutex);
+  errno = EAGAIN;
+  return -1;
+
+ERROR_RECEIVE_ZC:
+  pthread_mutex_unlock(&cb->mutex);
   fprintf(stderr, err);
   return -1;
 }
 
+// give back len bytes lent by tcp_api_recv_zc from the earliest, and open
+// the window for them
+int tcp_api_recv_release(int soc, size_t len) {
+  struct tcp_cb *cb;
+  struct timeval now;
+
+  // validate soc id
+  cb = tcp_cb_get(soc);
+  if (!cb) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cb->mutex);
+  if (!cb->used || len > cb->lent) {
+    pthread_mutex_unlock(&cb->mutex);
+    return -1;
+  }
+  cb->lent -= len;
+  if (cb->state == TCP_CB_STATE_CLOSED) {
+    // connection was aborted and only the buffer is left
+    if (!cb->lent) {
+      tcp_buf_put(&rcv_buf_pool, &cb->rcvbuf);
+    }
+    pthread_mutex_unlock(&cb->mutex);
+    return 0;
+  }
+  cb->rcv.rd += len;
+  gettimeofday(&now, NULL);
+  tcp_rcv_wnd_open(cb, &now);
+  if (!cb->lent && !tcp_rcv_unread(cb) && !cb->ooo) {
+    tcp_buf_put(&rcv_buf_pool, &cb->rcvbuf);
+  }
+  pthread_mutex_unlock(&cb->mutex);
+  return 0;
+}
+
 ssize_t tcp_api_send(int soc, uint8_t *buf, size_t len) {
   struct tcp_cb *cb;
   struct timeval now;
   size_t snt = 0, size;
-  uint16_t wnd;
+  uint32_t wnd;
   char *err;
 
   // validate soc id
-  if (TCP_SOCKET_INVALID(soc)) {
+  cb = tcp_cb_get(soc);
+  if (!cb) {
     return -1;
   }
 
-  pthread_mutex_lock(&mutex);
-  cb = &cb_table[soc];
+  pthread_mutex_lock(&cb->mutex);
   if (!cb->used) {
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return -1;
   }
 
@@ -1396,14 +3203,21 @@ TCP_API_SEND_NEXT:
       err = "error:  connection illegal for this process\n";
       goto ERROR_SEND;
 
-    case TCP_CB_STATE_LISTEN:
-      // TODO: change to active mode if foreign socket is specified
     case TCP_CB_STATE_SYN_SENT:
     case TCP_CB_STATE_SYN_RCVD:
+      if (cb->nonblock) {
+        // non-blocking connect is in progress
+        goto AGAIN_SEND;
+      }
       // TODO: wait change to ESTABLISHED
       err = "error:  connection illegal for this process\n";
       goto ERROR_SEND;
 
+    case TCP_CB_STATE_LISTEN:
+      // TODO: change to active mode if foreign socket is specified
+      err = "error:  connection illegal for this process\n";
+      goto ERROR_SEND;
+
     case TCP_CB_STATE_CLOSE_WAIT:
     case TCP_CB_STATE_ESTABLISHED:
       // send buf
@@ -1418,82 +3232,254 @@ TCP_API_SEND_NEXT:
       goto ERROR_SEND;
 
     default:
-      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&cb->mutex);
       return -1;
   }
 
   if (gettimeofday(&now, NULL) == -1) {
     perror("gettimeofday");
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
     return (snt == 0) ? -1 : ((ssize_t)snt);
   }
 
   if (len > 0) {
-    // mtu may changes, so calc size each time
-    size = cb->iface->dev->mtu - IP_HDR_SIZE_MAX - sizeof(struct tcp_hdr);
-
-    // check data size
-    if (len < size) {
-      size = len;
-    }
-
     // check send buffer size
-    wnd = TCP_SND_BUF_SIZE - (cb->snd.nxt - cb->snd.una);
-    if (wnd < size) {
-      size = wnd;
-      if (size <= 0) {
-        // wait until some data ack
-        fprintf(stderr,
-                ">>> send : wait for ack snd_buf_size: %d, snd.nxt: %u, "
-                "snd.una: %u <<<\n",
-                TCP_SND_BUF_SIZE, cb->snd.nxt, cb->snd.una);
-        pthread_cond_wait(&cb->cond, &mutex);
-        // retry
-        goto TCP_API_SEND_NEXT;
+    wnd = tcp_snd_space(cb);
+    if (wnd == 0) {
+      if (cb->nonblock) {
+        // partial send, or nothing is taken
+        goto AGAIN_SEND;
       }
+      // wait until acks make room
+#ifdef TCP_DEBUG
+      fprintf(stderr,
+              ">>> send : wait for ack snd_buf_size: %d, snd.nxt: %u, "
+              "snd.una: %u <<<\n",
+              TCP_SND_BUF_SIZE, cb->snd.nxt, cb->snd.una);
+#endif
+      pthread_cond_wait(&cb->cond, &cb->mutex);
+      // retry
+      goto TCP_API_SEND_NEXT;
     }
-
-    // send segment. if send window is not enough then stored into txq in tcp_tx
-    if (tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_PSH | TCP_FLG_ACK, &now,
-               buf + snt, size) == -1) {
-      // TODO: memory allocation error or ip_tx error
+    if (tcp_buf_get(&snd_buf_pool, &cb->sndbuf) == -1) {
+      // TODO: memory allocation error
+      pthread_mutex_unlock(&cb->mutex);
       return snt;
     }
-    cb->timeout = now.tv_sec + USER_TIMEOUT;
-    cb->snd.nxt += size;
+
+    // copy data to send buffer. it is cut into segments when sent
+    size = MIN(len, wnd);
+    ring_write(&cb->sndbuf, cb->snd.end, buf + snt, size);
+    cb->snd.end += size;
+    tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
     snt += size;
     len -= size;
+    tcp_txq_output(cb, &now);
 
     if (len > 0) {
-      // send next segment
+      // fill send buffer again
       goto TCP_API_SEND_NEXT;
     }
   }
 
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_unlock(&cb->mutex);
   // TODO: support urg pointer
   return snt;
 
+AGAIN_SEND:
+  pthread_mutex_unlock(&cb->mutex);
+  if (snt) {
+    return snt;
+  }
+  errno = EAGAIN;
+  return -1;
+
 ERROR_SEND:
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_unlock(&cb->mutex);
   fprintf(stderr, err);
   return -1;
 }
 
-int tcp_init(void) {
-  int i;
+ssize_t tcp_api_send_zc(int soc, const uint8_t *buf, size_t len,
+                        void (*done)(void *arg, int err), void *arg) {
+  struct tcp_cb *cb;
+  struct tcp_zc *zc, **pprev;
+  struct timeval now;
+  char *err;
 
-  // initialize mutex and condition variables
-  for (i = 0; i < TCP_CB_TABLE_SIZE; i++) {
-    pthread_cond_init(&cb_table[i].cond, NULL);
+  // validate soc id
+  cb = tcp_cb_get(soc);
+  if (!cb || !done || len > UINT32_MAX / 2) {
+    return -1;
+  }
+  if (len == 0) {
+    // buffer is not taken
+    return 0;
   }
-  pthread_mutex_init(&mutex, NULL);
-  pthread_cond_init(&timer_cond, NULL);
 
-  if (ip_add_protocol(IP_PROTOCOL_TCP, tcp_rx) == -1) {
+  pthread_mutex_lock(&cb->mutex);
+  if (!cb->used) {
+    pthread_mutex_unlock(&cb->mutex);
+    return -1;
+  }
+
+  switch (cb->state) {
+    case TCP_CB_STATE_CLOSE_WAIT:
+    case TCP_CB_STATE_ESTABLISHED:
+      break;
+
+    case TCP_CB_STATE_FIN_WAIT1:
+    case TCP_CB_STATE_FIN_WAIT2:
+    case TCP_CB_STATE_CLOSING:
+    case TCP_CB_STATE_TIME_WAIT:
+    case TCP_CB_STATE_LAST_ACK:
+      err = "error:  connection closing\n";
+      goto ERROR_SEND_ZC;
+
+    case TCP_CB_STATE_SYN_SENT:
+    case TCP_CB_STATE_SYN_RCVD:
+      if (cb->nonblock) {
+        errno = EAGAIN;
+        pthread_mutex_unlock(&cb->mutex);
+        return -1;
+      }
+      err = "error:  connection illegal for this process\n";
+      goto ERROR_SEND_ZC;
+
+    default:
+      err = "error:  connection illegal for this process\n";
+      goto ERROR_SEND_ZC;
+  }
+
+  zc = malloc(sizeof(struct tcp_zc));
+  if (!zc) {
+    err = "error:  memory allocation\n";
+    goto ERROR_SEND_ZC;
+  }
+  zc->seq = cb->snd.end;
+  zc->len = len;
+  zc->buf = buf;
+  zc->done = done;
+  zc->arg = arg;
+  zc->err = 0;
+  zc->next = NULL;
+  for (pprev = &cb->zc; *pprev; pprev = &(*pprev)->next)
+    ;
+  *pprev = zc;
+
+  // the buffer takes place of send buffer. it isn't limited by the size of
+  // send buffer since no room is needed, and data is read from it when sent
+  gettimeofday(&now, NULL);
+  cb->snd.end += len;
+  tcp_timer_set(&cb->user_timer, USER_TIMEOUT * 1000000ULL);
+  tcp_txq_output(cb, &now);
+  pthread_mutex_unlock(&cb->mutex);
+  return len;
+
+ERROR_SEND_ZC:
+  pthread_mutex_unlock(&cb->mutex);
+  fprintf(stderr, err);
+  return -1;
+}
+
+int tcp_api_setopt(int soc, int opt, const void *val, size_t len) {
+  struct tcp_cb *cb;
+  struct timeval now;
+  struct tcp_cc_ops *ops;
+  char name[TCP_CC_NAME_MAX];
+  char *err;
+
+  // validate soc id
+  cb = tcp_cb_get(soc);
+  if (!cb) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cb->mutex);
+  if (!cb->used) {
+    err = "error:  connection illegal for this process\n";
+    goto ERROR_SETOPT;
+  }
+
+  switch (opt) {
+    case TCP_OPT_CONGESTION:
+      memset(name, 0, sizeof(name));
+      memcpy(name, val, MIN(len, sizeof(name) - 1));
+      ops = tcp_cc_lookup(name);
+      if (!ops) {
+        err = "error:  unknown congestion control algorithm\n";
+        goto ERROR_SETOPT;
+      }
+      // algorithm is selected before the connection is opened
+      if (cb->state != TCP_CB_STATE_CLOSED &&
+          cb->state != TCP_CB_STATE_LISTEN) {
+        err = "error:  connection already exists\n";
+        goto ERROR_SETOPT;
+      }
+      cb->cc.ops = ops;
+      break;
+
+    case TCP_OPT_DELACK:
+      if (len != sizeof(uint32_t) ||
+          *(uint32_t *)val > TCP_DELACK_TIMEOUT_MAX) {
+        err = "error:  invalid delayed ack timeout\n";
+        goto ERROR_SETOPT;
+      }
+      cb->delack_timeout = *(uint32_t *)val;
+      break;
+
+    case TCP_OPT_NONBLOCK:
+      if (len != sizeof(int)) {
+        err = "error:  invalid option value\n";
+        goto ERROR_SETOPT;
+      }
+      cb->nonblock = !!*(int *)val;
+      // waiting calls return
+      pthread_cond_broadcast(&cb->cond);
+      break;
+
+    case TCP_OPT_NODELAY:
+    case TCP_OPT_CORK:
+      if (len != sizeof(int)) {
+        err = "error:  invalid option value\n";
+        goto ERROR_SETOPT;
+      }
+      if (opt == TCP_OPT_NODELAY) {
+        cb->nodelay = !!*(int *)val;
+      } else {
+        cb->cork = !!*(int *)val;
+      }
+      // push out held segment
+      if (cb->state != TCP_CB_STATE_CLOSED &&
+          cb->state != TCP_CB_STATE_LISTEN && !cb->cork) {
+        gettimeofday(&now, NULL);
+        tcp_txq_output(cb, &now);
+      }
+      break;
+
+    default:
+      err = "error:  unknown option\n";
+      goto ERROR_SETOPT;
+  }
+
+  pthread_mutex_unlock(&cb->mutex);
+  return 0;
+
+ERROR_SETOPT:
+  pthread_mutex_unlock(&cb->mutex);
+  fprintf(stderr, err);
+  return -1;
+}
+
+int tcp_init(void) {
+  if (timer_init() == -1) {
     return -1;
   }
-  if (pthread_create(&timer_thread, NULL, tcp_timer_thread, NULL) == -1) {
+  if (tcp_conn_rehash(TCP_CONN_HASH_BITS_MIN) == -1) {
+    return -1;
+  }
+
+  if (ip_add_protocol(IP_PROTOCOL_TCP, tcp_rx) == -1) {
     return -1;
   }
   return 0;
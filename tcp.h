@@ -5,6 +5,13 @@
 #include <unistd.h>
 #include "ip.h"
 
+// options of tcp_api_setopt
+#define TCP_OPT_CONGESTION 1 /* name of congestion control algorithm */
+#define TCP_OPT_DELACK 2     /* delayed ack timeout in usec (uint32_t) */
+#define TCP_OPT_NODELAY 3    /* disable Nagle algorithm (int) */
+#define TCP_OPT_CORK 4       /* hold partial segments until cleared (int) */
+#define TCP_OPT_NONBLOCK 5   /* fail with EAGAIN instead of waiting (int) */
+
 int tcp_init(void);
 int tcp_api_open(void);
 int tcp_api_close(int soc);
@@ -13,6 +20,17 @@ int tcp_api_bind(int soc, uint16_t port);
 int tcp_api_listen(int soc);
 int tcp_api_accept(int soc);
 ssize_t tcp_api_recv(int soc, uint8_t *buf, size_t size);
+// *data points to received data in place, valid until it is released.
+// successive calls return the data following, and the data is released
+// from the earliest by tcp_api_recv_release. tcp_api_recv fails meanwhile.
+ssize_t tcp_api_recv_zc(int soc, const uint8_t **data, size_t size);
+int tcp_api_recv_release(int soc, size_t len);
 ssize_t tcp_api_send(int soc, uint8_t *buf, size_t len);
+// buf is sent without being copied to send buffer, and must be left
+// unchanged until done is called with arg. err is 0 when all of it is acked,
+// -1 when the connection is aborted. done is called without socket locked.
+ssize_t tcp_api_send_zc(int soc, const uint8_t *buf, size_t len,
+                        void (*done)(void *arg, int err), void *arg);
+int tcp_api_setopt(int soc, int opt, const void *val, size_t len);
 
 #endif
@@ -0,0 +1,62 @@
+#include "tcp_cc.h"
+#include <stddef.h>
+#include <string.h>
+#include "util.h"
+
+extern struct tcp_cc_ops tcp_cc_newreno_ops;
+extern struct tcp_cc_ops tcp_cc_cubic_ops;
+
+static struct tcp_cc_ops *tcp_cc_table[] = {
+    &tcp_cc_newreno_ops,
+    &tcp_cc_cubic_ops,
+};
+
+// returns NULL if algorithm is not found
+struct tcp_cc_ops *tcp_cc_lookup(const char *name) {
+  size_t i;
+
+  for (i = 0; i < sizeof(tcp_cc_table) / sizeof(tcp_cc_table[0]); i++) {
+    if (strncmp(tcp_cc_table[i]->name, name, TCP_CC_NAME_MAX) == 0) {
+      return tcp_cc_table[i];
+    }
+  }
+  return NULL;
+}
+
+// start congestion control of new connection. ops is kept if already set
+void tcp_cc_init(struct tcp_cc *cc, uint32_t mss) {
+  if (!cc->ops) {
+    cc->ops = tcp_cc_lookup(TCP_CC_DEFAULT);
+  }
+  cc->mss = mss;
+  memset(cc->priv, 0, sizeof(cc->priv));
+  cc->ops->init(cc);
+}
+
+// https://tools.ietf.org/html/rfc5681#section-3.1
+uint32_t tcp_cc_initial_window(uint32_t mss) {
+  if (mss > 2190) {
+    return 2 * mss;
+  } else if (mss > 1095) {
+    return 3 * mss;
+  }
+  return 4 * mss;
+}
+
+// increase cwnd by acked bytes, at most 1 mss per ack. returns acked bytes
+// left for congestion avoidance when cwnd reaches ssthresh
+uint32_t tcp_cc_slow_start(struct tcp_cc *cc, uint32_t acked) {
+  uint32_t inc;
+
+  if (cc->cwnd >= cc->ssthresh) {
+    return acked;
+  }
+  inc = MIN(acked, cc->mss);
+  if (inc < cc->ssthresh - cc->cwnd) {
+    cc->cwnd += inc;
+    return 0;
+  }
+  acked -= cc->ssthresh - cc->cwnd;
+  cc->cwnd = cc->ssthresh;
+  return acked;
+}
@@ -0,0 +1,39 @@
+#ifndef _TCP_CC_H_
+#define _TCP_CC_H_
+
+#include <stdint.h>
+
+#define TCP_CC_NAME_MAX 16
+#define TCP_CC_DEFAULT "newreno"
+
+struct tcp_cc;
+
+// congestion control algorithm. all sizes are in bytes and times in usec.
+// callbacks are called with mutex of the connection.
+struct tcp_cc_ops {
+  char *name;
+  // set initial cwnd and ssthresh. mss is set before
+  void (*init)(struct tcp_cc *cc);
+  // acked bytes are newly acknowledged. rtt is smoothed rtt, 0 if unknown
+  void (*on_ack)(struct tcp_cc *cc, uint32_t acked, uint32_t rtt,
+                 uint64_t now);
+  // loss detected by duplicate acks. flight is bytes in flight
+  void (*on_loss)(struct tcp_cc *cc, uint32_t flight, uint64_t now);
+  // retransmission timeout
+  void (*on_rto)(struct tcp_cc *cc, uint32_t flight, uint64_t now);
+};
+
+struct tcp_cc {
+  struct tcp_cc_ops *ops;
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t mss;
+  uint64_t priv[8];  // private data of algorithm
+};
+
+struct tcp_cc_ops *tcp_cc_lookup(const char *name);
+void tcp_cc_init(struct tcp_cc *cc, uint32_t mss);
+uint32_t tcp_cc_initial_window(uint32_t mss);
+uint32_t tcp_cc_slow_start(struct tcp_cc *cc, uint32_t acked);
+
+#endif
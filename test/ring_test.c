@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+
+int main(int argc, char const *argv[]) {
+  int failed = 0;
+  uint8_t storage[16], data[16], out[16];
+  struct ring ring = {storage, sizeof(storage) - 1};
+  uint32_t pos;
+  uint8_t *ptr;
+  size_t len;
+  int i;
+
+  for (i = 0; i < (int)sizeof(data); i++) {
+    data[i] = i + 1;
+  }
+
+  memset(storage, 0, sizeof(storage));
+  ring_write(&ring, 4, data, 8);
+  if (memcmp(storage + 4, data, 8) != 0) {
+    fprintf(stderr, "check failed : write without wrap\n");
+    failed++;
+  }
+  ring_read(&ring, 4, out, 8);
+  if (memcmp(out, data, 8) != 0) {
+    fprintf(stderr, "check failed : read without wrap\n");
+    failed++;
+  }
+
+  // 6 bytes at the end and 6 bytes at the head
+  memset(storage, 0, sizeof(storage));
+  ring_write(&ring, 10, data, 12);
+  if (memcmp(storage + 10, data, 6) != 0 ||
+      memcmp(storage, data + 6, 6) != 0) {
+    fprintf(stderr, "check failed : write with wrap\n");
+    failed++;
+  }
+  memset(out, 0, sizeof(out));
+  ring_read(&ring, 10, out, 12);
+  if (memcmp(out, data, 12) != 0) {
+    fprintf(stderr, "check failed : read with wrap\n");
+    failed++;
+  }
+
+  // position wraps around 32 bit counter
+  pos = UINT32_MAX - 2;
+  ring_write(&ring, pos, data, sizeof(data));
+  memset(out, 0, sizeof(out));
+  ring_read(&ring, pos, out, sizeof(out));
+  if (memcmp(out, data, sizeof(data)) != 0) {
+    fprintf(stderr, "check failed : read whole ring at counter wrap\n");
+    failed++;
+  }
+  memset(out, 0, sizeof(out));
+  ring_read(&ring, pos + 5, out, 4);
+  if (memcmp(out, data + 5, 4) != 0) {
+    fprintf(stderr, "check failed : read after counter wrap\n");
+    failed++;
+  }
+
+  // peek returns the part before the wrap, and the rest from the head
+  ring_write(&ring, 10, data, 12);
+  len = 12;
+  ptr = ring_peek(&ring, 10, &len);
+  if (ptr != storage + 10 || len != 6 || memcmp(ptr, data, len) != 0) {
+    fprintf(stderr, "check failed : peek before wrap\n");
+    failed++;
+  }
+  len = 6;
+  ptr = ring_peek(&ring, 16, &len);
+  if (ptr != storage || len != 6 || memcmp(ptr, data + 6, len) != 0) {
+    fprintf(stderr, "check failed : peek after wrap\n");
+    failed++;
+  }
+
+  if (!failed) {
+    fprintf(stderr, "TEST SUCCESS!\n");
+    return 0;
+  } else {
+    fprintf(stderr, "TEST FAILED : %d errors\n", failed);
+    return 1;
+  }
+}
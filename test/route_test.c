@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include "ethernet.h"
+#include "ip.h"
+#include "net.h"
+
+static struct netif *netif_alloc(const char *name, const char *addr,
+                                 const char *netmask) {
+  struct netdev *dev;
+
+  dev = netdev_alloc(NETDEV_TYPE_ETHERNET);
+  if (!dev) {
+    return NULL;
+  }
+  memset(dev->name, 0, sizeof(dev->name));
+  strncpy(dev->name, name, sizeof(dev->name) - 1);
+  dev->ifs = NULL;
+  return ip_netif_register(dev, addr, netmask, NULL);
+}
+
+static int check_peer(const char *peer, struct netif *expected) {
+  ip_addr_t addr;
+
+  ip_addr_pton(peer, &addr);
+  return ip_netif_by_peer(&addr) == expected;
+}
+
+int main(int argc, char const *argv[]) {
+  int failed = 0;
+  struct netif *netif1, *netif2;
+
+  if (ethernet_init() == -1) {
+    fprintf(stderr, "ethernet_init(): failure\n");
+    return 1;
+  }
+
+  netif1 = netif_alloc("tap1", "192.168.33.11", "255.255.255.0");
+  netif2 = netif_alloc("tap3", "192.168.34.11", "255.255.255.0");
+  if (!netif1 || !netif2) {
+    fprintf(stderr, "check failed : register netif\n");
+    return 1;
+  }
+
+  if (!check_peer("192.168.33.10", netif1)) {
+    fprintf(stderr, "check failed : connected route 1\n");
+    failed++;
+  }
+  if (!check_peer("192.168.34.10", netif2)) {
+    fprintf(stderr, "check failed : connected route 2\n");
+    failed++;
+  }
+
+  if (ip_route_add("10.0.0.0", "255.0.0.0", "192.168.33.1", netif1) != 0) {
+    fprintf(stderr, "check failed : add 10.0.0.0/8\n");
+    failed++;
+  }
+  if (ip_route_add("10.1.0.0", "255.255.0.0", "192.168.34.1", netif2) != 0) {
+    fprintf(stderr, "check failed : add 10.1.0.0/16\n");
+    failed++;
+  }
+  if (!check_peer("10.2.3.4", netif1)) {
+    fprintf(stderr, "check failed : lookup /8\n");
+    failed++;
+  }
+  if (!check_peer("10.1.3.4", netif2)) {
+    fprintf(stderr, "check failed : longest prefix /16\n");
+    failed++;
+  }
+
+  if (ip_route_add("0.0.0.0", "0.0.0.0", "192.168.34.1", netif2) != 0) {
+    fprintf(stderr, "check failed : add default route\n");
+    failed++;
+  }
+  if (!check_peer("8.8.8.8", netif2)) {
+    fprintf(stderr, "check failed : default route\n");
+    failed++;
+  }
+  if (!check_peer("192.168.33.10", netif1)) {
+    fprintf(stderr, "check failed : connected route over default route\n");
+    failed++;
+  }
+
+  if (ip_route_add("10.0.0.0", "255.0.0.0", NULL, NULL) != -1) {
+    fprintf(stderr, "check failed : add route without netif\n");
+    failed++;
+  }
+
+  if (!failed) {
+    fprintf(stderr, "TEST SUCCESS!\n");
+    return 0;
+  } else {
+    fprintf(stderr, "TEST FAILED : %d errors\n", failed);
+    return 1;
+  }
+}
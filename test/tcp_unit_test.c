@@ -0,0 +1,1433 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// segments sent by tcp.c are captured here instead of being sent by ip, so
+// that the test plays the peer and checks the internals of cbs
+#define ip_tx test_ip_tx
+#include "../tcp.c"
+#undef ip_tx
+
+#define SEG_MAX 256
+#define SEG_DATA_MAX 64 /* leading bytes of data kept for checks */
+
+#define PEER_ISS 1000
+#define SELF_PORT 7
+
+struct seg {
+  uint16_t dst;  // network byte order
+  uint32_t seq;
+  uint32_t ack;
+  uint8_t flg;
+  uint16_t win;
+  struct tcp_opts opts;
+  size_t plen;
+  uint8_t data[SEG_DATA_MAX];
+};
+
+// connection of the peer played by the test
+struct conn {
+  int soc;
+  struct tcp_cb *cb;
+  uint16_t port;           // peer port in network byte order
+  uint16_t local;          // port of the cb in network byte order
+  uint32_t snd_nxt;        // next sequence number peer sends
+  uint32_t rcv_nxt;        // sequence number peer expects
+  uint32_t iss;            // iss of the cb
+  struct tcp_opts synack;  // options of SYN-ACK
+  uint16_t synack_win;
+  uint16_t win;  // window field peer sends
+  int ts;        // peer sends timestamps
+  uint32_t tsval;
+};
+
+static struct netdev dev = {.mtu = 1500};
+static struct netif_ip iface;
+static ip_addr_t self_addr, peer_addr;
+static int listener;
+static uint16_t next_port = 40000;
+
+// timers send segments too, so the queue is locked
+static struct seg segs[SEG_MAX];
+static int seg_head = 0, seg_num = 0;
+static pthread_mutex_t seg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+ssize_t test_ip_tx(struct netif *netif, uint8_t protocol, const uint8_t *buf,
+                   size_t len, const ip_addr_t *dst) {
+  struct tcp_hdr *hdr;
+  struct seg *seg;
+
+  hdr = (struct tcp_hdr *)buf;
+  pthread_mutex_lock(&seg_mutex);
+  if (seg_num < SEG_MAX) {
+    seg = &segs[(seg_head + seg_num++) % SEG_MAX];
+    seg->dst = hdr->dst;
+    seg->seq = ntoh32(hdr->seq);
+    seg->ack = ntoh32(hdr->ack);
+    seg->flg = hdr->flg;
+    seg->win = ntoh16(hdr->win);
+    tcp_opts_parse(hdr, &seg->opts);
+    seg->plen = TCP_DATA_LEN(hdr, len);
+    memcpy(seg->data, buf + TCP_HDR_LEN(hdr), MIN(seg->plen, SEG_DATA_MAX));
+  }
+  pthread_mutex_unlock(&seg_mutex);
+  return len;
+}
+
+// take the next segment sent to the connection. segments of others are
+// dropped. returns -1 if there is none
+static int seg_pop(struct conn *c, struct seg *seg) {
+  int ret = -1;
+
+  pthread_mutex_lock(&seg_mutex);
+  while (seg_num) {
+    *seg = segs[seg_head];
+    seg_head = (seg_head + 1) % SEG_MAX;
+    seg_num--;
+    if (seg->dst == c->port) {
+      ret = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&seg_mutex);
+  return ret;
+}
+
+// drop segments sent so far, and returns the number of them
+static int seg_flush(struct conn *c) {
+  struct seg seg;
+  int n = 0;
+
+  while (seg_pop(c, &seg) == 0) {
+    n++;
+  }
+  return n;
+}
+
+// build options of a segment from peer
+static size_t opts_put(struct tcp_opts *opts, uint8_t *opt) {
+  size_t optlen = 0;
+  uint32_t v;
+  int i;
+
+  if (opts->mss) {
+    opt[optlen++] = TCP_HDR_OPT_MSS;
+    opt[optlen++] = 4;
+    opt[optlen++] = opts->mss >> 8;
+    opt[optlen++] = opts->mss & 0xff;
+  }
+  if (opts->wscale_ok) {
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_WSCALE;
+    opt[optlen++] = 3;
+    opt[optlen++] = opts->wscale;
+  }
+  if (opts->sack_permitted) {
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_SACK_PERMITTED;
+    opt[optlen++] = 2;
+  }
+  if (opts->ts_ok) {
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_TIMESTAMP;
+    opt[optlen++] = TCP_HDR_OPT_TIMESTAMP_LEN;
+    v = hton32(opts->tsval);
+    memcpy(opt + optlen, &v, 4);
+    v = hton32(opts->tsecr);
+    memcpy(opt + optlen + 4, &v, 4);
+    optlen += 8;
+  }
+  if (opts->sack_num) {
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_NOP;
+    opt[optlen++] = TCP_HDR_OPT_SACK;
+    opt[optlen++] = 2 + 8 * opts->sack_num;
+    for (i = 0; i < opts->sack_num; i++) {
+      v = hton32(opts->sack[i].start);
+      memcpy(opt + optlen, &v, 4);
+      v = hton32(opts->sack[i].end);
+      memcpy(opt + optlen + 4, &v, 4);
+      optlen += 8;
+    }
+  }
+  return optlen;
+}
+
+// deliver a segment from peer to tcp_rx
+static void peer_tx(struct conn *c, uint32_t seq, uint32_t ack, uint8_t flg,
+                    struct tcp_opts *opts, const uint8_t *data, size_t len) {
+  uint8_t segment[IP_PAYLOAD_SIZE_MAX];
+  struct tcp_hdr *hdr;
+  size_t hlen;
+
+  hdr = (struct tcp_hdr *)segment;
+  hlen = sizeof(struct tcp_hdr) + opts_put(opts, (uint8_t *)(hdr + 1));
+  hdr->src = c->port;
+  hdr->dst = c->local;
+  hdr->seq = hton32(seq);
+  hdr->ack = hton32(ack);
+  hdr->off = (hlen >> 2) << 4;
+  hdr->flg = flg;
+  hdr->win = hton16(c->win);
+  hdr->sum = 0;
+  hdr->urg = 0;
+  memcpy(segment + hlen, data, len);
+  hdr->sum = tcp_checksum(peer_addr, self_addr, segment, hlen + len);
+  tcp_rx(segment, hlen + len, &peer_addr, &self_addr, (struct netif *)&iface);
+}
+
+// options peer puts on every segment
+static void peer_opts(struct conn *c, struct tcp_opts *opts) {
+  memset(opts, 0, sizeof(*opts));
+  if (c->ts) {
+    opts->ts_ok = 1;
+    opts->tsval = c->tsval;
+    opts->tsecr = c->cb->ts_ok ? tcp_ts_now() : 0;
+  }
+}
+
+// send data or an ack from the current position of peer. sack_num blocks
+// of sack are attached
+static void peer_send(struct conn *c, uint8_t flg, const uint8_t *data,
+                      size_t len, struct tcp_sack_block *sack, int sack_num) {
+  struct tcp_opts opts;
+
+  peer_opts(c, &opts);
+  opts.sack_num = sack_num;
+  if (sack_num) {
+    memcpy(opts.sack, sack, sack_num * sizeof(*sack));
+  }
+  peer_tx(c, c->snd_nxt, c->rcv_nxt, flg, &opts, data, len);
+  c->snd_nxt += len;
+}
+
+// send data at off bytes from the current position of peer, which doesn't
+// move
+static void peer_send_at(struct conn *c, uint32_t off, const uint8_t *data,
+                         size_t len) {
+  struct tcp_opts opts;
+
+  peer_opts(c, &opts);
+  peer_tx(c, c->snd_nxt + off, c->rcv_nxt, TCP_FLG_ACK, &opts, data, len);
+}
+
+// open a connection to the listener with options of SYN, and accept it
+static int conn_open(struct conn *c, struct tcp_opts *syn) {
+  struct tcp_opts opts = {};
+  struct seg seg;
+
+  memset(c, 0, sizeof(*c));
+  c->port = hton16(next_port++);
+  c->local = hton16(SELF_PORT);
+  c->win = 65535;
+  c->ts = syn->ts_ok;
+  c->tsval = syn->tsval;
+  c->snd_nxt = PEER_ISS;
+  peer_tx(c, c->snd_nxt, 0, TCP_FLG_SYN, syn, NULL, 0);
+  c->snd_nxt++;
+  if (seg_pop(c, &seg) == -1 ||
+      !TCP_FLG_IS(seg.flg, TCP_FLG_SYN | TCP_FLG_ACK) ||
+      seg.ack != c->snd_nxt) {
+    return -1;
+  }
+  c->iss = seg.seq;
+  c->synack = seg.opts;
+  c->synack_win = seg.win;
+  c->rcv_nxt = seg.seq + 1;
+  if (c->ts) {
+    opts.ts_ok = 1;
+    opts.tsval = c->tsval;
+    opts.tsecr = seg.opts.tsval;
+  }
+  peer_tx(c, c->snd_nxt, c->rcv_nxt, TCP_FLG_ACK, &opts, NULL, 0);
+  c->soc = tcp_api_accept(listener);
+  c->cb = tcp_cb_get(c->soc);
+  if (!c->cb || c->cb->state != TCP_CB_STATE_ESTABLISHED) {
+    return -1;
+  }
+  return 0;
+}
+
+// abort the connection by RST from peer, and close the socket
+static void conn_close(struct conn *c) {
+  struct tcp_opts opts = {};
+
+  peer_tx(c, c->snd_nxt, 0, TCP_FLG_RST, &opts, NULL, 0);
+  tcp_api_close(c->soc);
+  seg_flush(c);
+}
+
+// recount the SACK scoreboard from the queue
+static int scoreboard_valid(struct tcp_cb *cb) {
+  struct tcp_txq_entry *txq;
+  uint32_t sacked = 0, sacked_bytes = 0, pipe = 0, snt = 0;
+  int ret;
+
+  pthread_mutex_lock(&cb->mutex);
+  for (txq = cb->txq.head; txq; txq = txq->next) {
+    if (txq->sacked) {
+      sacked++;
+      sacked_bytes += txq->len;
+    }
+    pipe += tcp_txq_pipe(txq);
+    snt += txq->len;
+  }
+  ret = sacked == cb->txq.sacked && sacked_bytes == cb->txq.sacked_bytes &&
+        pipe == cb->txq.pipe && snt == cb->txq.snt &&
+        cb->txq.lost_sacked <= sacked &&
+        cb->txq.lost_sacked_bytes <= sacked_bytes;
+  pthread_mutex_unlock(&cb->mutex);
+  return ret;
+}
+
+/*
+ * SACK
+ */
+
+static int test_sack(void) {
+  struct tcp_opts syn = {.mss = 1000, .sack_permitted = 1};
+  struct tcp_sack_block sack[2];
+  struct conn c;
+  struct seg seg;
+  uint8_t data[4000] = {};
+  uint32_t s;
+  int failed = 0, one = 1, n;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection with SACK\n");
+    return 1;
+  }
+  if (!c.cb->sack_ok) {
+    fprintf(stderr, "check failed : SACK is permitted\n");
+    failed++;
+  }
+  tcp_api_setopt(c.soc, TCP_OPT_NODELAY, &one, sizeof(one));
+
+  // four segments fill the initial window
+  s = c.cb->snd.nxt;
+  if (tcp_api_send(c.soc, data, sizeof(data)) != sizeof(data)) {
+    fprintf(stderr, "check failed : send 4 segments\n");
+    failed++;
+  }
+  for (n = 0; seg_pop(&c, &seg) == 0; n++) {
+    if (seg.seq != s + n * 1000 || seg.plen != 1000) {
+      fprintf(stderr, "check failed : segment %d (seq %u, len %zu)\n", n,
+              seg.seq - s, seg.plen);
+      failed++;
+    }
+  }
+  if (n != 4) {
+    fprintf(stderr, "check failed : %d segments sent\n", n);
+    failed++;
+  }
+
+  // the second segment is SACKed, and then acked in two steps. the part
+  // acked first must leave the scoreboard only once
+  sack[0].start = s + 1000;
+  sack[0].end = s + 2000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, sack, 1);
+  if (c.cb->txq.sacked != 1 || c.cb->txq.sacked_bytes != 1000 ||
+      c.cb->txq.pipe != 3000) {
+    fprintf(stderr, "check failed : SACKed segment (%u, %u, pipe %u)\n",
+            c.cb->txq.sacked, c.cb->txq.sacked_bytes, c.cb->txq.pipe);
+    failed++;
+  }
+  c.rcv_nxt = s + 1500;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, sack, 1);
+  if (c.cb->txq.sacked != 1 || c.cb->txq.sacked_bytes != 500 ||
+      !scoreboard_valid(c.cb)) {
+    fprintf(stderr, "check failed : partial ack of SACKed segment (%u, %u)\n",
+            c.cb->txq.sacked, c.cb->txq.sacked_bytes);
+    failed++;
+  }
+  c.rcv_nxt = s + 2000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (c.cb->txq.sacked || c.cb->txq.sacked_bytes ||
+      c.cb->txq.lost_sacked || c.cb->txq.lost_sacked_bytes ||
+      !scoreboard_valid(c.cb)) {
+    fprintf(stderr, "check failed : ack of SACKed segment (%u, %u, %u, %u)\n",
+            c.cb->txq.sacked, c.cb->txq.sacked_bytes, c.cb->txq.lost_sacked,
+            c.cb->txq.lost_sacked_bytes);
+    failed++;
+  }
+  // the window opened by the acks takes new data
+  seg_flush(&c);
+
+  // the ack clocked out a fifth segment. the segments SACKed by two blocks
+  // above the head make it lost, and it is retransmitted at once
+  s = c.cb->snd.una;
+  if (tcp_api_send(c.soc, data, sizeof(data)) != sizeof(data)) {
+    fprintf(stderr, "check failed : send again\n");
+    failed++;
+  }
+  seg_flush(&c);
+  if (c.cb->snd.nxt - s < 5000) {
+    fprintf(stderr, "check failed : %u bytes in flight\n", c.cb->snd.nxt - s);
+    failed++;
+  }
+  sack[0].start = s + 1000;
+  sack[0].end = s + 3000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, sack, 1);
+  if (c.cb->recovering != TCP_RECOVERY_NONE || c.cb->txq.head->lost ||
+      c.cb->txq.sacked != 2 || !scoreboard_valid(c.cb)) {
+    fprintf(stderr, "check failed : two segments SACKed (%u, %u)\n",
+            c.cb->recovering, c.cb->txq.sacked);
+    failed++;
+  }
+  if (seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : sent before loss is detected\n");
+    failed++;
+  }
+  sack[1] = sack[0];
+  sack[0].start = s + 4000;
+  sack[0].end = s + 5000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, sack, 2);
+  if (c.cb->recovering != TCP_RECOVERY_FAST || !c.cb->txq.head->lost ||
+      c.cb->txq.sacked != 3 || !scoreboard_valid(c.cb)) {
+    fprintf(stderr, "check failed : loss detected by SACK (%u, %u)\n",
+            c.cb->recovering, c.cb->txq.sacked);
+    failed++;
+  }
+  if (seg_pop(&c, &seg) == -1 || seg.seq != s || seg.plen != 1000) {
+    fprintf(stderr, "check failed : retransmission of the hole\n");
+    failed++;
+  }
+  seg_flush(&c);
+
+  // the ack of everything ends the recovery and empties the scoreboard
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (c.cb->recovering != TCP_RECOVERY_NONE || c.cb->txq.sacked ||
+      c.cb->txq.sacked_bytes || c.cb->txq.lost_sacked ||
+      c.cb->txq.lost_sacked_bytes || !scoreboard_valid(c.cb)) {
+    fprintf(stderr, "check failed : full ack after recovery (%u, %u, %u)\n",
+            c.cb->recovering, c.cb->txq.sacked, c.cb->txq.lost_sacked);
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Out-of-order reassembly
+ */
+
+static int test_ooo(void) {
+  struct tcp_opts syn = {.mss = 1000, .sack_permitted = 1};
+  struct conn c;
+  struct seg seg;
+  uint8_t data[4000], buf[4000];
+  uint32_t s;
+  int failed = 0, i;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for reassembly\n");
+    return 1;
+  }
+  for (i = 0; i < (int)sizeof(data); i++) {
+    data[i] = i * 7;
+  }
+  s = c.snd_nxt;
+
+  // a segment beyond a hole is kept, and a duplicate ack reports it at once
+  peer_send_at(&c, 1000, data + 1000, 1000);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != s || seg.opts.sack_num != 1 ||
+      seg.opts.sack[0].start != s + 1000 || seg.opts.sack[0].end != s + 2000) {
+    fprintf(stderr, "check failed : duplicate ack with SACK block\n");
+    failed++;
+  }
+  if (c.cb->rcv.nxt != s || c.cb->ooo_num != 1) {
+    fprintf(stderr, "check failed : out-of-order range (%u)\n",
+            c.cb->ooo_num);
+    failed++;
+  }
+
+  // a second range is reported first
+  peer_send_at(&c, 3000, data + 3000, 1000);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != s || seg.opts.sack_num != 2 ||
+      seg.opts.sack[0].start != s + 3000 ||
+      seg.opts.sack[1].start != s + 1000) {
+    fprintf(stderr, "check failed : two SACK blocks\n");
+    failed++;
+  }
+  if (c.cb->ooo_num != 2) {
+    fprintf(stderr, "check failed : two out-of-order ranges (%u)\n",
+            c.cb->ooo_num);
+    failed++;
+  }
+
+  // the gap between them merges the ranges
+  peer_send_at(&c, 2000, data + 2000, 1000);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != s || seg.opts.sack_num != 1 ||
+      seg.opts.sack[0].start != s + 1000 || seg.opts.sack[0].end != s + 4000) {
+    fprintf(stderr, "check failed : merged SACK block\n");
+    failed++;
+  }
+  if (c.cb->ooo_num != 1) {
+    fprintf(stderr, "check failed : merged range (%u)\n", c.cb->ooo_num);
+    failed++;
+  }
+
+  // a duplicate inside the range changes nothing
+  peer_send_at(&c, 1500, data + 1500, 1000);
+  seg_flush(&c);
+  if (c.cb->ooo_num != 1 || c.cb->sack_num != 1 || c.cb->rcv.nxt != s) {
+    fprintf(stderr, "check failed : duplicate out-of-order segment\n");
+    failed++;
+  }
+
+  // filling the hole delivers everything, and is acked at once
+  peer_send(&c, TCP_FLG_ACK, data, 1000, NULL, 0);
+  c.snd_nxt = s + sizeof(data);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != s + 4000 || seg.opts.sack_num) {
+    fprintf(stderr, "check failed : ack after the hole is filled\n");
+    failed++;
+  }
+  if (c.cb->rcv.nxt != s + 4000 || c.cb->ooo || c.cb->ooo_num ||
+      c.cb->sack_num || c.cb->rcv.wnd != TCP_RCV_BUF_SIZE - 4000) {
+    fprintf(stderr, "check failed : reassembled (rcv.nxt %u, %u ranges)\n",
+            c.cb->rcv.nxt - s, c.cb->ooo_num);
+    failed++;
+  }
+  if (tcp_api_recv(c.soc, buf, sizeof(buf)) != sizeof(buf) ||
+      memcmp(buf, data, sizeof(data))) {
+    fprintf(stderr, "check failed : reassembled data\n");
+    failed++;
+  }
+
+  // an old segment is trimmed away, and acked
+  peer_send_at(&c, -1000, data + 3000, 1000);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != s + 4000 ||
+      c.cb->rcv.nxt != s + 4000) {
+    fprintf(stderr, "check failed : old duplicate segment\n");
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Window scale
+ */
+
+static int test_wscale(void) {
+  struct tcp_opts syn = {.mss = 1000, .wscale_ok = 1, .wscale = 7};
+  struct conn c;
+  struct seg seg;
+  uint8_t data[1000] = {};
+  int failed = 0;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection with window scale\n");
+    return 1;
+  }
+  if (!c.synack.wscale_ok || c.synack.wscale != TCP_RCV_WSCALE ||
+      c.synack_win != 65535) {
+    fprintf(stderr, "check failed : window scale on SYN-ACK\n");
+    failed++;
+  }
+  if (c.cb->snd.wscale != 7 || c.cb->rcv.wscale != TCP_RCV_WSCALE) {
+    fprintf(stderr, "check failed : negotiated shift counts (%u, %u)\n",
+            c.cb->snd.wscale, c.cb->rcv.wscale);
+    failed++;
+  }
+  // window of the handshake ack is scaled, but not the one of SYN
+  if (c.cb->snd.wnd != 65535U << 7) {
+    fprintf(stderr, "check failed : scaled send window (%u)\n",
+            c.cb->snd.wnd);
+    failed++;
+  }
+  c.win = 100;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (c.cb->snd.wnd != 100 << 7) {
+    fprintf(stderr, "check failed : window update (%u)\n", c.cb->snd.wnd);
+    failed++;
+  }
+  // our window is advertised shifted
+  peer_send(&c, TCP_FLG_ACK, data, sizeof(data), NULL, 0);
+  if (seg_pop(&c, &seg) == -1 ||
+      seg.win != (TCP_RCV_BUF_SIZE - sizeof(data)) >> TCP_RCV_WSCALE) {
+    fprintf(stderr, "check failed : advertised window field (%u)\n",
+            seg.win);
+    failed++;
+  }
+  conn_close(&c);
+
+  // shift count is limited
+  syn.wscale = 20;
+  if (conn_open(&c, &syn) == -1 || c.cb->snd.wscale != TCP_WSCALE_MAX) {
+    fprintf(stderr, "check failed : shift count over the limit\n");
+    failed++;
+  }
+  conn_close(&c);
+
+  // without the option windows are not scaled in either direction
+  syn.wscale_ok = 0;
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection without window scale\n");
+    return failed + 1;
+  }
+  // the option is answered only if peer offered it
+  if (c.synack.wscale_ok) {
+    fprintf(stderr, "check failed : window scale is not offered\n");
+    failed++;
+  }
+  if (c.cb->snd.wscale || c.cb->rcv.wscale || c.cb->snd.wnd != 65535) {
+    fprintf(stderr, "check failed : unscaled windows (%u, %u, %u)\n",
+            c.cb->snd.wscale, c.cb->rcv.wscale, c.cb->snd.wnd);
+    failed++;
+  }
+  peer_send(&c, TCP_FLG_ACK, data, sizeof(data), NULL, 0);
+  if (seg_pop(&c, &seg) == -1 || seg.win != 65535) {
+    fprintf(stderr, "check failed : unscaled window field (%u)\n", seg.win);
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Timestamps
+ */
+
+static int test_timestamps(void) {
+  struct tcp_opts syn = {.mss = 1000, .ts_ok = 1, .tsval = 5000}, opts = {};
+  struct conn c;
+  struct seg seg;
+  uint8_t data[1000] = {};
+  uint32_t s;
+  int failed = 0;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection with timestamps\n");
+    return 1;
+  }
+  if (!c.cb->ts_ok || !c.synack.ts_ok || c.synack.tsecr != 5000) {
+    fprintf(stderr, "check failed : timestamps on SYN-ACK\n");
+    failed++;
+  }
+
+  // a newer timestamp is echoed
+  c.tsval = 6000;
+  s = c.snd_nxt;
+  peer_send(&c, TCP_FLG_ACK, data, sizeof(data), NULL, 0);
+  if (seg_pop(&c, &seg) == -1 || !seg.opts.ts_ok || seg.opts.tsecr != 6000 ||
+      c.cb->ts_recent != 6000) {
+    fprintf(stderr, "check failed : echo of timestamp\n");
+    failed++;
+  }
+
+  // an out-of-order segment doesn't move the timestamp to be echoed
+  c.tsval = 7000;
+  peer_send_at(&c, 1000, data, sizeof(data));
+  if (seg_pop(&c, &seg) == -1 || seg.opts.tsecr != 6000 ||
+      c.cb->ts_recent != 6000) {
+    fprintf(stderr, "check failed : timestamp of out-of-order segment\n");
+    failed++;
+  }
+
+  // PAWS drops a segment with an older timestamp, and acks it
+  c.tsval = 5500;
+  peer_send(&c, TCP_FLG_ACK, data, sizeof(data), NULL, 0);
+  c.snd_nxt -= sizeof(data);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != s + 1000 ||
+      c.cb->rcv.nxt != s + 1000 || c.cb->ts_recent != 6000) {
+    fprintf(stderr, "check failed : PAWS (rcv.nxt %u)\n",
+            c.cb->rcv.nxt - s);
+    failed++;
+  }
+
+  // a segment without timestamp is dropped silently
+  peer_tx(&c, c.snd_nxt, c.rcv_nxt, TCP_FLG_ACK, &opts, data, sizeof(data));
+  if (seg_pop(&c, &seg) == 0 || c.cb->rcv.nxt != s + 1000) {
+    fprintf(stderr, "check failed : segment without timestamp\n");
+    failed++;
+  }
+
+  // the option takes room of data
+  if (tcp_cb_mss(c.cb) != 1000 - TCP_HDR_OPT_TIMESTAMP_LEN - 2) {
+    fprintf(stderr, "check failed : segment size with timestamps (%u)\n",
+            tcp_cb_mss(c.cb));
+    failed++;
+  }
+
+  // the echo gives an RTT sample even for a retransmitted segment
+  c.tsval = 8000;
+  tcp_api_send(c.soc, data, 100);
+  seg_flush(&c);
+  pthread_mutex_lock(&c.cb->mutex);
+  c.cb->txq.head->rexmt = 1;
+  pthread_mutex_unlock(&c.cb->mutex);
+  opts.ts_ok = 1;
+  opts.tsval = c.tsval;
+  opts.tsecr = tcp_ts_now() - 100;
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_tx(&c, c.snd_nxt, c.rcv_nxt, TCP_FLG_ACK, &opts, NULL, 0);
+  if (c.cb->snd.una != c.rcv_nxt || c.cb->srtt < 100000 / 8) {
+    fprintf(stderr, "check failed : RTT sample from timestamp (srtt %u)\n",
+            c.cb->srtt);
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * MSS
+ */
+
+// send len bytes and check that they are cut into segments of mss bytes
+static int check_segments(struct conn *c, size_t len, uint32_t mss) {
+  static uint8_t data[4096];
+  struct seg seg;
+  uint32_t s;
+  int n = 0;
+
+  s = c->cb->snd.nxt;
+  if (tcp_api_send(c->soc, data, len) != (ssize_t)len) {
+    return -1;
+  }
+  while (seg_pop(c, &seg) == 0) {
+    if (seg.seq != s + n * mss || seg.plen != MIN(mss, len - n * mss)) {
+      return -1;
+    }
+    n++;
+  }
+  return n == (int)((len + mss - 1) / mss) ? 0 : -1;
+}
+
+static int test_mss(void) {
+  struct tcp_opts syn = {.mss = 1000};
+  struct conn c;
+  int failed = 0;
+
+  // ours is taken from mtu of the interface
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection with MSS\n");
+    return 1;
+  }
+  if (c.synack.mss != dev.mtu - IP_HDR_SIZE_MIN - sizeof(struct tcp_hdr)) {
+    fprintf(stderr, "check failed : MSS on SYN-ACK (%u)\n", c.synack.mss);
+    failed++;
+  }
+  // the smaller one is used, and it sizes the initial window
+  if (c.cb->mss != 1000 || c.cb->cc.cwnd != tcp_cc_initial_window(1000) ||
+      check_segments(&c, 3000, 1000) == -1) {
+    fprintf(stderr, "check failed : MSS of peer (%u)\n", c.cb->mss);
+    failed++;
+  }
+  // a smaller mtu limits segments of the connection
+  dev.mtu = 940;
+  if (tcp_cb_mss(c.cb) != 900) {
+    fprintf(stderr, "check failed : segment size after mtu change (%u)\n",
+            tcp_cb_mss(c.cb));
+    failed++;
+  }
+  dev.mtu = 1500;
+  conn_close(&c);
+
+  syn.mss = 9000;
+  if (conn_open(&c, &syn) == -1 || c.cb->mss != 1460 ||
+      check_segments(&c, 2920, 1460) == -1) {
+    fprintf(stderr, "check failed : MSS limited by interface\n");
+    failed++;
+  }
+  conn_close(&c);
+
+  // assumed if peer doesn't send the option
+  syn.mss = 0;
+  if (conn_open(&c, &syn) == -1 || c.cb->mss != TCP_DEFAULT_MSS ||
+      check_segments(&c, 2 * TCP_DEFAULT_MSS, TCP_DEFAULT_MSS) == -1) {
+    fprintf(stderr, "check failed : default MSS\n");
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Delayed ack
+ */
+
+static int test_delack(void) {
+  struct tcp_opts syn = {.mss = 1000};
+  struct conn c;
+  struct seg seg;
+  uint8_t data[2000] = {};
+  uint32_t timeout;
+  int failed = 0, i;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for delayed ack\n");
+    return 1;
+  }
+
+  // segments are acked at once while peer is in slow start
+  for (i = 0; i < TCP_QUICKACK_SEGS; i++) {
+    peer_send(&c, TCP_FLG_ACK, data, 100, NULL, 0);
+    if (seg_pop(&c, &seg) == -1 || seg.ack != c.snd_nxt) {
+      fprintf(stderr, "check failed : quick ack %d\n", i);
+      failed++;
+    }
+  }
+
+  // and then delayed until the timer fires
+  peer_send(&c, TCP_FLG_ACK, data, 100, NULL, 0);
+  if (seg_pop(&c, &seg) == 0 || !tcp_timer_armed(&c.cb->delack_timer)) {
+    fprintf(stderr, "check failed : ack is delayed\n");
+    failed++;
+  }
+  usleep(TCP_DELACK_TIMEOUT * 5);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != c.snd_nxt || seg.plen) {
+    fprintf(stderr, "check failed : delayed ack by timer\n");
+    failed++;
+  }
+
+  // every second full-sized segment is acked at once
+  peer_send(&c, TCP_FLG_ACK, data, 1000, NULL, 0);
+  if (seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : first full-sized segment is delayed\n");
+    failed++;
+  }
+  peer_send(&c, TCP_FLG_ACK, data, 1000, NULL, 0);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != c.snd_nxt) {
+    fprintf(stderr, "check failed : ack of two full-sized segments\n");
+    failed++;
+  }
+
+  // the delayed ack rides on reply data, and the timer sends nothing more
+  peer_send(&c, TCP_FLG_ACK, data, 100, NULL, 0);
+  tcp_api_send(c.soc, data, 100);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != c.snd_nxt || seg.plen != 100 ||
+      c.cb->delack_bytes) {
+    fprintf(stderr, "check failed : ack piggybacked on data\n");
+    failed++;
+  }
+  // the reply is acked, so that it isn't retransmitted meanwhile
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  usleep(TCP_DELACK_TIMEOUT * 5);
+  if (seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : ack sent again by timer\n");
+    failed++;
+  }
+
+  // a hole makes acks quick again
+  peer_send_at(&c, 1000, data, 100);
+  seg_flush(&c);
+  if (c.cb->quickack != TCP_QUICKACK_SEGS) {
+    fprintf(stderr, "check failed : quick acks after a hole (%u)\n",
+            c.cb->quickack);
+    failed++;
+  }
+  peer_send(&c, TCP_FLG_ACK, data, 1000, NULL, 0);
+  c.snd_nxt += 100;
+  seg_flush(&c);
+
+  // zero timeout acks every segment
+  pthread_mutex_lock(&c.cb->mutex);
+  c.cb->quickack = 0;
+  pthread_mutex_unlock(&c.cb->mutex);
+  timeout = 0;
+  if (tcp_api_setopt(c.soc, TCP_OPT_DELACK, &timeout, sizeof(timeout)) ==
+      -1) {
+    fprintf(stderr, "check failed : set delayed ack timeout\n");
+    failed++;
+  }
+  peer_send(&c, TCP_FLG_ACK, data, 100, NULL, 0);
+  if (seg_pop(&c, &seg) == -1 || seg.ack != c.snd_nxt) {
+    fprintf(stderr, "check failed : ack without delay\n");
+    failed++;
+  }
+  timeout = TCP_DELACK_TIMEOUT_MAX + 1;
+  if (tcp_api_setopt(c.soc, TCP_OPT_DELACK, &timeout, sizeof(timeout)) !=
+      -1) {
+    fprintf(stderr, "check failed : timeout over the limit is taken\n");
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Nagle algorithm and cork
+ */
+
+static int test_nagle(void) {
+  struct tcp_opts syn = {.mss = 1000};
+  struct conn c;
+  struct seg seg;
+  uint8_t data[2000] = {};
+  int failed = 0, on = 1, off = 0;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for Nagle\n");
+    return 1;
+  }
+
+  // a small segment waits while another small one is unacknowledged
+  tcp_api_send(c.soc, data, 100);
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 100) {
+    fprintf(stderr, "check failed : first small segment\n");
+    failed++;
+  }
+  tcp_api_send(c.soc, data, 100);
+  if (seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : small segment is held\n");
+    failed++;
+  }
+  // full-sized segments are not held
+  tcp_api_send(c.soc, data, 1850);
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 1000 || seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : full-sized segment is sent\n");
+    failed++;
+  }
+  // the ack of the small segment releases the rest
+  c.rcv_nxt = c.cb->iss + 101;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 950) {
+    fprintf(stderr, "check failed : held data after ack\n");
+    failed++;
+  }
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  seg_flush(&c);
+
+  // no delay sends small segments at once
+  tcp_api_setopt(c.soc, TCP_OPT_NODELAY, &on, sizeof(on));
+  tcp_api_send(c.soc, data, 100);
+  tcp_api_send(c.soc, data, 100);
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 100 || seg_pop(&c, &seg) == -1 ||
+      seg.plen != 100) {
+    fprintf(stderr, "check failed : small segments with no delay\n");
+    failed++;
+  }
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  seg_flush(&c);
+
+  // cork holds partial segments even with no delay, and sends full ones
+  tcp_api_setopt(c.soc, TCP_OPT_CORK, &on, sizeof(on));
+  tcp_api_send(c.soc, data, 100);
+  tcp_api_send(c.soc, data, 100);
+  if (seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : corked segment is held\n");
+    failed++;
+  }
+  tcp_api_send(c.soc, data, 1000);
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 1000 || seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : full-sized segment while corked\n");
+    failed++;
+  }
+  // clearing it pushes out the rest
+  tcp_api_setopt(c.soc, TCP_OPT_CORK, &off, sizeof(off));
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 200 ||
+      !TCP_FLG_ISSET(seg.flg, TCP_FLG_PSH)) {
+    fprintf(stderr, "check failed : corked data pushed out\n");
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Ack clock
+ */
+
+struct send_arg {
+  int soc;
+  size_t len;
+  ssize_t ret;
+  int done;
+};
+
+static void *send_thread(void *arg) {
+  struct send_arg *a = arg;
+  uint8_t *data;
+
+  data = calloc(1, a->len);
+  a->ret = tcp_api_send(a->soc, data, a->len);
+  free(data);
+  __atomic_store_n(&a->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int test_ack_clock(void) {
+  struct tcp_opts syn = {.mss = 1000};
+  struct conn c;
+  struct send_arg arg;
+  pthread_t thread;
+  uint8_t data[10000] = {};
+  uint32_t s, end;
+  int failed = 0, one = 1, n, i;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for ack clock\n");
+    return 1;
+  }
+  tcp_api_setopt(c.soc, TCP_OPT_NODELAY, &one, sizeof(one));
+
+  // the initial window goes out at once, and the rest waits for acks
+  s = c.cb->snd.nxt;
+  tcp_api_send(c.soc, data, sizeof(data));
+  n = seg_flush(&c);
+  if (n != 4 || c.cb->txq.snt != 4000) {
+    fprintf(stderr, "check failed : initial window (%d segments)\n", n);
+    failed++;
+  }
+  // an ack releases acked segments and sends new ones inline
+  c.rcv_nxt = s + 2000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  n = seg_flush(&c);
+  if (n < 2 || c.cb->txq.head->seq != s + 2000 ||
+      c.cb->txq.snt != c.cb->snd.nxt - c.cb->snd.una) {
+    fprintf(stderr, "check failed : segments clocked out by ack (%d)\n", n);
+    failed++;
+  }
+  // window of peer limits them too
+  c.win = 3000;
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  n = seg_flush(&c);
+  if (n != 3 || c.cb->txq.snt != 3000) {
+    fprintf(stderr, "check failed : window limited flight (%d)\n", n);
+    failed++;
+  }
+  for (i = 0; i < 10 && c.cb->snd.una != c.cb->snd.end; i++) {
+    c.rcv_nxt = c.cb->snd.nxt;
+    peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+    seg_flush(&c);
+  }
+  if (c.cb->snd.una != s + sizeof(data) || c.cb->txq.head ||
+      tcp_timer_armed(&c.cb->rexmt_timer)) {
+    fprintf(stderr, "check failed : everything acked\n");
+    failed++;
+  }
+
+  // a sender blocked on full send buffer is woken only when a good part of
+  // it is free
+  c.win = 65535;
+  arg.soc = c.soc;
+  arg.len = TCP_SND_BUF_SIZE + 1000;
+  arg.done = 0;
+  s = c.cb->snd.una;
+  pthread_create(&thread, NULL, send_thread, &arg);
+  for (i = 0; i < 1000 && c.cb->snd.end - s != TCP_SND_BUF_SIZE; i++) {
+    usleep(1000);
+  }
+  if (i == 1000) {
+    fprintf(stderr, "check failed : send buffer is filled\n");
+    failed++;
+  }
+  seg_flush(&c);
+  end = c.cb->snd.end;
+  c.rcv_nxt = s + 1000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  usleep(50000);
+  if (__atomic_load_n(&arg.done, __ATOMIC_ACQUIRE) || c.cb->snd.end != end) {
+    fprintf(stderr, "check failed : sender is woken below low-water mark\n");
+    failed++;
+  }
+  for (i = 0; i < 1000 && c.cb->snd.una - s < TCP_SND_LOWAT; i++) {
+    seg_flush(&c);
+    c.rcv_nxt = c.cb->snd.nxt;
+    peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  }
+  pthread_join(thread, NULL);
+  if (arg.ret != (ssize_t)arg.len) {
+    fprintf(stderr, "check failed : blocked sender (%zd)\n", arg.ret);
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Silly window syndrome avoidance and zero window probes
+ */
+
+static int test_window(void) {
+  struct tcp_opts syn = {.mss = 1000};
+  struct conn c;
+  struct seg seg;
+  uint8_t data[3000] = {}, buf[1000];
+  uint32_t left;
+  int failed = 0, one = 1, n;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for windows\n");
+    return 1;
+  }
+  tcp_api_setopt(c.soc, TCP_OPT_NODELAY, &one, sizeof(one));
+
+  // peer fills our window
+  while ((left = c.cb->rcv.wnd)) {
+    peer_send(&c, TCP_FLG_ACK, data, MIN(left, 1000), NULL, 0);
+    seg_flush(&c);
+  }
+  // a small read doesn't open the window
+  tcp_api_recv(c.soc, buf, 100);
+  if (seg_pop(&c, &seg) == 0 || c.cb->rcv.wnd) {
+    fprintf(stderr, "check failed : small window is not offered (%u)\n",
+            c.cb->rcv.wnd);
+    failed++;
+  }
+  // a full segment of room opens it, and peer is told at once
+  tcp_api_recv(c.soc, buf, 900);
+  if (seg_pop(&c, &seg) == -1 || seg.win != 1000 || c.cb->rcv.wnd != 1000) {
+    fprintf(stderr, "check failed : window update (%u)\n", c.cb->rcv.wnd);
+    failed++;
+  }
+  // the right edge moves again only by a full segment
+  tcp_api_recv(c.soc, buf, 500);
+  if (seg_pop(&c, &seg) == 0 || c.cb->rcv.wnd != 1000) {
+    fprintf(stderr, "check failed : window update by small read\n");
+    failed++;
+  }
+  conn_close(&c);
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for windows\n");
+    return failed + 1;
+  }
+  tcp_api_setopt(c.soc, TCP_OPT_NODELAY, &one, sizeof(one));
+
+  // a segment isn't shortened to a small part of the window left
+  c.win = 3000;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  tcp_api_send(c.soc, data, 2500);
+  n = seg_flush(&c);
+  tcp_api_send(c.soc, data, 1000);
+  if (n != 3 || seg_pop(&c, &seg) == 0) {
+    fprintf(stderr, "check failed : sender SWS avoidance (%d)\n", n);
+    failed++;
+  }
+
+  // zero window holds the data, and probes go out until it opens
+  c.win = 0;
+  c.rcv_nxt = c.cb->snd.nxt;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (seg_pop(&c, &seg) == 0 || !tcp_timer_armed(&c.cb->persist_timer)) {
+    fprintf(stderr, "check failed : persist timer\n");
+    failed++;
+  }
+  usleep(c.cb->persist + 100000);
+  if (seg_pop(&c, &seg) == -1 || seg.seq != c.cb->snd.una - 1 || seg.plen ||
+      c.cb->snd.nxt != c.cb->snd.una) {
+    fprintf(stderr, "check failed : zero window probe\n");
+    failed++;
+  }
+  if (c.cb->persist <= TCP_RTO_MIN / 2) {
+    fprintf(stderr, "check failed : probe interval backed off (%u)\n",
+            c.cb->persist);
+    failed++;
+  }
+  c.win = 65535;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  seg_flush(&c);
+  if (c.cb->snd.nxt != c.cb->snd.end) {
+    fprintf(stderr, "check failed : data sent after window opened\n");
+    failed++;
+  }
+  conn_close(&c);
+  return failed;
+}
+
+/*
+ * Zero-copy send
+ */
+
+struct zc_arg {
+  int called;
+  int err;
+};
+
+static void zc_callback(void *arg, int err) {
+  struct zc_arg *a = arg;
+
+  a->called++;
+  a->err = err;
+}
+
+static int test_send_zc(void) {
+  struct tcp_opts syn = {.mss = 1000};
+  struct conn c;
+  struct seg seg;
+  struct zc_arg arg = {}, arg2 = {};
+  uint8_t data[100], zc[2000];
+  uint32_t s;
+  int failed = 0, one = 1, i;
+
+  if (conn_open(&c, &syn) == -1) {
+    fprintf(stderr, "check failed : open connection for zero-copy\n");
+    return 1;
+  }
+  tcp_api_setopt(c.soc, TCP_OPT_NODELAY, &one, sizeof(one));
+  memset(data, 0xaa, sizeof(data));
+  for (i = 0; i < (int)sizeof(zc); i++) {
+    zc[i] = i;
+  }
+  if (tcp_api_send_zc(c.soc, zc, 0, zc_callback, &arg) != 0 ||
+      tcp_api_send_zc(c.soc, zc, sizeof(zc), NULL, NULL) != -1) {
+    fprintf(stderr, "check failed : invalid zero-copy send\n");
+    failed++;
+  }
+
+  // lent buffer is sent in place between copied data
+  s = c.cb->snd.nxt;
+  tcp_api_send(c.soc, data, sizeof(data));
+  if (tcp_api_send_zc(c.soc, zc, sizeof(zc), zc_callback, &arg) !=
+      sizeof(zc)) {
+    fprintf(stderr, "check failed : zero-copy send\n");
+    failed++;
+  }
+  tcp_api_send(c.soc, data, sizeof(data));
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 100 || seg.data[0] != 0xaa) {
+    fprintf(stderr, "check failed : copied data before lent buffer\n");
+    failed++;
+  }
+  if (seg_pop(&c, &seg) == -1 || seg.seq != s + 100 || seg.plen != 1000 ||
+      memcmp(seg.data, zc, SEG_DATA_MAX)) {
+    fprintf(stderr, "check failed : segment from lent buffer\n");
+    failed++;
+  }
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 1000 ||
+      memcmp(seg.data, zc + 1000, SEG_DATA_MAX)) {
+    fprintf(stderr, "check failed : second segment from lent buffer\n");
+    failed++;
+  }
+  if (seg_pop(&c, &seg) == -1 || seg.plen != 100 || seg.data[0] != 0xaa) {
+    fprintf(stderr, "check failed : copied data after lent buffer\n");
+    failed++;
+  }
+
+  // the buffer is returned when its last byte is acked
+  c.rcv_nxt = s + 2099;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (arg.called) {
+    fprintf(stderr, "check failed : buffer returned before acked\n");
+    failed++;
+  }
+  c.rcv_nxt = s + 2100;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  if (arg.called != 1 || arg.err) {
+    fprintf(stderr, "check failed : buffer returned by ack (%d, %d)\n",
+            arg.called, arg.err);
+    failed++;
+  }
+
+  // and with an error when the connection is aborted
+  tcp_api_send_zc(c.soc, zc, sizeof(zc), zc_callback, &arg2);
+  conn_close(&c);
+  if (arg.called != 1 || arg2.called != 1 || arg2.err != -1) {
+    fprintf(stderr, "check failed : buffer returned by abort (%d, %d)\n",
+            arg2.called, arg2.err);
+    failed++;
+  }
+  return failed;
+}
+
+/*
+ * Non-blocking mode
+ */
+
+struct connect_arg {
+  int soc;
+  int ret;
+  int err;
+};
+
+static void *connect_thread(void *arg) {
+  struct connect_arg *a = arg;
+
+  a->ret = tcp_api_connect(a->soc, &peer_addr, 80);
+  a->err = errno;
+  return NULL;
+}
+
+// start non-blocking connect to port 80 of peer
+static int conn_connect(struct conn *c) {
+  struct seg seg;
+  int one = 1;
+
+  memset(c, 0, sizeof(*c));
+  c->port = hton16(80);
+  c->win = 65535;
+  c->soc = tcp_api_open();
+  c->cb = tcp_cb_get(c->soc);
+  tcp_api_setopt(c->soc, TCP_OPT_NONBLOCK, &one, sizeof(one));
+  errno = 0;
+  if (tcp_api_connect(c->soc, &peer_addr, 80) != -1 || errno != EINPROGRESS ||
+      seg_pop(c, &seg) == -1 || !TCP_FLG_IS(seg.flg, TCP_FLG_SYN)) {
+    return -1;
+  }
+  c->local = c->cb->port;
+  c->iss = seg.seq;
+  c->snd_nxt = PEER_ISS;
+  c->rcv_nxt = seg.seq + 1;
+  return 0;
+}
+
+static int test_nonblock(void) {
+  struct tcp_opts syn = {.mss = 1000}, opts = {};
+  struct conn c;
+  struct connect_arg arg;
+  pthread_t thread;
+  uint8_t *data, buf[100];
+  int failed = 0, one = 1, zero = 0, i;
+
+  // accept returns at once with empty backlog
+  tcp_api_setopt(listener, TCP_OPT_NONBLOCK, &one, sizeof(one));
+  errno = 0;
+  if (tcp_api_accept(listener) != -1 || errno != EAGAIN) {
+    fprintf(stderr, "check failed : accept with empty backlog\n");
+    failed++;
+  }
+  // and accepted sockets are non-blocking too
+  if (conn_open(&c, &syn) == -1 || !c.cb->nonblock) {
+    fprintf(stderr, "check failed : non-blocking accepted socket\n");
+    return failed + 1;
+  }
+  tcp_api_setopt(listener, TCP_OPT_NONBLOCK, &zero, sizeof(zero));
+
+  errno = 0;
+  if (tcp_api_recv(c.soc, buf, sizeof(buf)) != -1 || errno != EAGAIN) {
+    fprintf(stderr, "check failed : recv without data\n");
+    failed++;
+  }
+  // send takes what fits in send buffer
+  c.win = 0;
+  peer_send(&c, TCP_FLG_ACK, NULL, 0, NULL, 0);
+  data = calloc(1, TCP_SND_BUF_SIZE + 1000);
+  if (tcp_api_send(c.soc, data, TCP_SND_BUF_SIZE + 1000) != TCP_SND_BUF_SIZE) {
+    fprintf(stderr, "check failed : partial send\n");
+    failed++;
+  }
+  errno = 0;
+  if (tcp_api_send(c.soc, data, 1000) != -1 || errno != EAGAIN) {
+    fprintf(stderr, "check failed : send to full buffer\n");
+    failed++;
+  }
+  free(data);
+  conn_close(&c);
+
+  // connect is in progress until SYN-ACK, and reports the result once
+  if (conn_connect(&c) == -1) {
+    fprintf(stderr, "check failed : non-blocking connect\n");
+    return failed + 1;
+  }
+  errno = 0;
+  if (tcp_api_connect(c.soc, &peer_addr, 80) != -1 || errno != EALREADY) {
+    fprintf(stderr, "check failed : connect in progress\n");
+    failed++;
+  }
+  errno = 0;
+  if (tcp_api_recv(c.soc, buf, sizeof(buf)) != -1 || errno != EAGAIN ||
+      tcp_api_send(c.soc, buf, sizeof(buf)) != -1 || errno != EAGAIN) {
+    fprintf(stderr, "check failed : recv and send while connecting\n");
+    failed++;
+  }
+  peer_tx(&c, c.snd_nxt, c.rcv_nxt, TCP_FLG_SYN | TCP_FLG_ACK, &syn, NULL, 0);
+  c.snd_nxt++;
+  if (c.cb->state != TCP_CB_STATE_ESTABLISHED ||
+      tcp_api_connect(c.soc, &peer_addr, 80) != 0) {
+    fprintf(stderr, "check failed : result of connect\n");
+    failed++;
+  }
+  if (tcp_api_connect(c.soc, &peer_addr, 80) != -1) {
+    fprintf(stderr, "check failed : connect of connected socket\n");
+    failed++;
+  }
+  conn_close(&c);
+
+  // refused by RST
+  if (conn_connect(&c) == -1) {
+    fprintf(stderr, "check failed : non-blocking connect\n");
+    return failed + 1;
+  }
+  peer_tx(&c, 0, c.rcv_nxt, TCP_FLG_RST | TCP_FLG_ACK, &opts, NULL, 0);
+  errno = 0;
+  if (tcp_api_connect(c.soc, &peer_addr, 80) != -1 || errno != ECONNREFUSED) {
+    fprintf(stderr, "check failed : refused connect\n");
+    failed++;
+  }
+  tcp_api_close(c.soc);
+
+  // blocked connect returns when the socket is switched to non-blocking
+  arg.soc = tcp_api_open();
+  pthread_create(&thread, NULL, connect_thread, &arg);
+  for (i = 0; i < 1000; i++) {
+    if (tcp_cb_get(arg.soc)->state == TCP_CB_STATE_SYN_SENT) {
+      break;
+    }
+    usleep(1000);
+  }
+  tcp_api_setopt(arg.soc, TCP_OPT_NONBLOCK, &one, sizeof(one));
+  pthread_join(thread, NULL);
+  if (arg.ret != -1 || arg.err != EINPROGRESS) {
+    fprintf(stderr, "check failed : connect switched to non-blocking\n");
+    failed++;
+  }
+  tcp_api_close(arg.soc);
+  c.port = hton16(80);
+  seg_flush(&c);
+  return failed;
+}
+
+static int setup(void) {
+  if (ip_init() == -1 || tcp_init() == -1) {
+    fprintf(stderr, "init : failure\n");
+    return -1;
+  }
+  ip_addr_pton("10.0.0.1", &self_addr);
+  ip_addr_pton("10.0.0.2", &peer_addr);
+  iface.netif.family = NETIF_FAMILY_IPV4;
+  iface.netif.dev = &dev;
+  iface.unicast = self_addr;
+  ip_addr_pton("255.255.255.0", &iface.netmask);
+  iface.network = self_addr & iface.netmask;
+  iface.broadcast = iface.network | ~iface.netmask;
+  if (ip_route_add("10.0.0.0", "255.255.255.0", NULL,
+                   (struct netif *)&iface) == -1) {
+    fprintf(stderr, "ip_route_add : failure\n");
+    return -1;
+  }
+
+  listener = tcp_api_open();
+  if (listener == -1 || tcp_api_bind(listener, SELF_PORT) == -1 ||
+      tcp_api_listen(listener) == -1) {
+    fprintf(stderr, "listen : failure\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char const *argv[]) {
+  int failed = 0;
+
+  if (setup() == -1) {
+    return -1;
+  }
+
+  failed += test_sack();
+  failed += test_ooo();
+  failed += test_wscale();
+  failed += test_timestamps();
+  failed += test_mss();
+  failed += test_delack();
+  failed += test_nagle();
+  failed += test_ack_clock();
+  failed += test_window();
+  failed += test_send_zc();
+  failed += test_nonblock();
+
+  if (!failed) {
+    fprintf(stderr, "TEST SUCCESS!\n");
+    return 0;
+  } else {
+    fprintf(stderr, "TEST FAILED : %d errors\n", failed);
+    return 1;
+  }
+}
@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "timer.h"
+
+#define TIMER_TEST_NUM 6
+#define TIMER_TEST_SLACK_MSEC 50
+
+struct timer_test {
+  struct timer timer;
+  uint64_t msec;    // requested delay
+  uint64_t fired;   // msec since start
+  int count;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec start;
+
+static uint64_t elapsed_msec(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) * 1000 +
+         (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static void timer_test_func(void *arg) {
+  struct timer_test *test;
+
+  test = (struct timer_test *)arg;
+  pthread_mutex_lock(&mutex);
+  test->fired = elapsed_msec();
+  test->count++;
+  pthread_mutex_unlock(&mutex);
+}
+
+int main(int argc, char const *argv[]) {
+  int failed = 0;
+  struct timer_test tests[TIMER_TEST_NUM] = {
+      {.msec = 0},   {.msec = 5},    {.msec = 70},
+      {.msec = 300}, {.msec = 100},  {.msec = 5000},
+  };
+  struct timer_test *canceled = &tests[4], *far = &tests[5];
+  int i;
+
+  if (timer_init() == -1) {
+    fprintf(stderr, "timer_init(): failure\n");
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < TIMER_TEST_NUM; i++) {
+    timer_setup(&tests[i].timer, timer_test_func, &tests[i]);
+    timer_add(&tests[i].timer, tests[i].msec * 1000);
+  }
+  if (!timer_pending(&canceled->timer)) {
+    fprintf(stderr, "check failed : pending\n");
+    failed++;
+  }
+  if (timer_del(&canceled->timer) != 1) {
+    fprintf(stderr, "check failed : delete pending timer\n");
+    failed++;
+  }
+  if (timer_del(&canceled->timer) != 0) {
+    fprintf(stderr, "check failed : delete deleted timer\n");
+    failed++;
+  }
+  // re-arm a timer far on the upper level to fire soon
+  far->msec = 150;
+  timer_add(&far->timer, far->msec * 1000);
+
+  usleep(500 * 1000);
+
+  pthread_mutex_lock(&mutex);
+  for (i = 0; i < TIMER_TEST_NUM; i++) {
+    if (&tests[i] == canceled) {
+      if (tests[i].count) {
+        fprintf(stderr, "check failed : canceled timer fired\n");
+        failed++;
+      }
+      continue;
+    }
+    if (tests[i].count != 1) {
+      fprintf(stderr, "check failed : timer %d fired %d times\n", i,
+              tests[i].count);
+      failed++;
+      continue;
+    }
+    if (tests[i].fired < tests[i].msec ||
+        tests[i].fired > tests[i].msec + TIMER_TEST_SLACK_MSEC) {
+      fprintf(stderr, "check failed : timer %d fired at %lu msec (%lu)\n", i,
+              (unsigned long)tests[i].fired, (unsigned long)tests[i].msec);
+      failed++;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  if (timer_pending(&tests[3].timer)) {
+    fprintf(stderr, "check failed : fired timer is pending\n");
+    failed++;
+  }
+
+  if (!failed) {
+    fprintf(stderr, "TEST SUCCESS!\n");
+    return 0;
+  } else {
+    fprintf(stderr, "TEST FAILED : %d errors\n", failed);
+    return 1;
+  }
+}
@@ -0,0 +1,257 @@
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+// hierarchical timing wheel: level 0 covers the next 64 ticks one slot per
+// tick, each upper level covers 64 times the range of the level below with
+// coarser slots that are cascaded down when the wheel clock reaches them.
+#define TIMER_TICK_USEC 100
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define TIMER_LEVELS 5
+#define TIMER_RANGE_MAX ((1ULL << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+#define TIMER_NEVER UINT64_MAX
+
+static struct timer *wheel[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static uint64_t wheel_bitmap[TIMER_LEVELS];  // non-empty slots
+static uint64_t wheel_clock;   // next tick to be processed
+static uint64_t wheel_wakeup;  // tick the thread is sleeping until
+static struct timespec epoch;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static pthread_t thread;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int initialized;
+
+static uint64_t timer_now_usec(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - epoch.tv_sec) * 1000000 +
+         (now.tv_nsec - epoch.tv_nsec) / 1000;
+}
+
+static uint64_t timer_now(void) { return timer_now_usec() / TIMER_TICK_USEC; }
+
+static void timer_enqueue(struct timer *timer) {
+  uint64_t expires, delta;
+  int level;
+  unsigned int idx;
+
+  expires = timer->expires;
+  if (expires < wheel_clock) {
+    expires = wheel_clock;
+  }
+  delta = expires - wheel_clock;
+  if (delta > TIMER_RANGE_MAX) {
+    // beyond the wheel: park in the farthest slot and cascade from there
+    expires = wheel_clock + TIMER_RANGE_MAX;
+    delta = TIMER_RANGE_MAX;
+  }
+  for (level = 0; level < TIMER_LEVELS - 1; level++) {
+    if (delta < (1ULL << ((level + 1) * TIMER_LEVEL_BITS))) {
+      break;
+    }
+  }
+  idx = (expires >> (level * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK;
+  timer->slot = level * TIMER_LEVEL_SIZE + idx;
+  timer->next = wheel[level][idx];
+  if (timer->next) {
+    timer->next->pprev = &timer->next;
+  }
+  wheel[level][idx] = timer;
+  timer->pprev = &wheel[level][idx];
+  wheel_bitmap[level] |= 1ULL << idx;
+}
+
+static void timer_dequeue(struct timer *timer) {
+  unsigned int level, idx;
+
+  *timer->pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+  level = timer->slot / TIMER_LEVEL_SIZE;
+  idx = timer->slot % TIMER_LEVEL_SIZE;
+  if (!wheel[level][idx]) {
+    wheel_bitmap[level] &= ~(1ULL << idx);
+  }
+}
+
+static void timer_cascade(int level) {
+  unsigned int idx;
+  struct timer *timer, *next;
+
+  idx = (wheel_clock >> (level * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK;
+  timer = wheel[level][idx];
+  wheel[level][idx] = NULL;
+  wheel_bitmap[level] &= ~(1ULL << idx);
+  while (timer) {
+    next = timer->next;
+    timer_enqueue(timer);
+    timer = next;
+  }
+}
+
+// the first tick at or after wheel_clock at which a non-empty slot is due,
+// either to fire (level 0) or to be cascaded (upper levels)
+static uint64_t timer_next_expiry(void) {
+  uint64_t next = TIMER_NEVER, base, bitmap, tick;
+  int level, shift, rot;
+
+  for (level = 0; level < TIMER_LEVELS; level++) {
+    bitmap = wheel_bitmap[level];
+    if (!bitmap) {
+      continue;
+    }
+    shift = level * TIMER_LEVEL_BITS;
+    base = (wheel_clock + (1ULL << shift) - 1) >> shift;
+    rot = base & TIMER_LEVEL_MASK;
+    if (rot) {
+      bitmap = (bitmap >> rot) | (bitmap << (TIMER_LEVEL_SIZE - rot));
+    }
+    tick = (base + __builtin_ctzll(bitmap)) << shift;
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+// runs every timer due at wheel_clock; callbacks are invoked without the lock
+// held, so they must re-validate the state of the object they belong to.
+static void timer_run(void) {
+  int level;
+  unsigned int idx;
+  struct timer *timer;
+  void (*func)(void *);
+  void *arg;
+
+  for (level = 1; level < TIMER_LEVELS; level++) {
+    if (wheel_clock & ((1ULL << (level * TIMER_LEVEL_BITS)) - 1)) {
+      break;
+    }
+    timer_cascade(level);
+  }
+  idx = wheel_clock & TIMER_LEVEL_MASK;
+  while ((timer = wheel[0][idx]) != NULL) {
+    timer_dequeue(timer);
+    func = timer->func;
+    arg = timer->arg;
+    pthread_mutex_unlock(&mutex);
+    func(arg);
+    pthread_mutex_lock(&mutex);
+  }
+  wheel_clock++;
+}
+
+static void *timer_thread(void *arg) {
+  uint64_t now, next;
+  struct timespec abstime;
+
+  pthread_mutex_lock(&mutex);
+  while (1) {
+    now = timer_now();
+    while (wheel_clock <= now) {
+      next = timer_next_expiry();
+      if (next > now) {
+        wheel_clock = now + 1;
+        break;
+      }
+      // nothing is due in between, skip the empty ticks
+      wheel_clock = next;
+      timer_run();
+    }
+    wheel_wakeup = timer_next_expiry();
+    if (wheel_wakeup == TIMER_NEVER) {
+      pthread_cond_wait(&cond, &mutex);
+    } else {
+      next = wheel_wakeup * TIMER_TICK_USEC;
+      abstime.tv_sec = epoch.tv_sec + next / 1000000;
+      abstime.tv_nsec = epoch.tv_nsec + (next % 1000000) * 1000;
+      if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&cond, &mutex, &abstime);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static void timer_init_once(void) {
+  pthread_condattr_t attr;
+
+  clock_gettime(CLOCK_MONOTONIC, &epoch);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &attr);
+  pthread_condattr_destroy(&attr);
+  wheel_wakeup = TIMER_NEVER;
+  if (pthread_create(&thread, NULL, timer_thread, NULL) != 0) {
+    fprintf(stderr, "pthread_create: failure\n");
+    return;
+  }
+  initialized = 1;
+}
+
+int timer_init(void) {
+  pthread_once(&once, timer_init_once);
+  return initialized ? 0 : -1;
+}
+
+void timer_setup(struct timer *timer, void (*func)(void *), void *arg) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->slot = 0;
+  timer->func = func;
+  timer->arg = arg;
+}
+
+// (re)arms the timer to fire once after usec microseconds
+void timer_add(struct timer *timer, uint64_t usec) {
+  pthread_mutex_lock(&mutex);
+  if (timer->pprev) {
+    timer_dequeue(timer);
+  }
+  // round up, so that the timer never fires early
+  timer->expires =
+      (timer_now_usec() + usec + TIMER_TICK_USEC - 1) / TIMER_TICK_USEC;
+  timer_enqueue(timer);
+  if (timer->expires < wheel_wakeup) {
+    wheel_wakeup = timer->expires;
+    pthread_cond_signal(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// returns 1 if the timer was pending; a callback that has already been
+// dispatched may still be running when this returns 0
+int timer_del(struct timer *timer) {
+  int pending = 0;
+
+  pthread_mutex_lock(&mutex);
+  if (timer->pprev) {
+    timer_dequeue(timer);
+    pending = 1;
+  }
+  pthread_mutex_unlock(&mutex);
+  return pending;
+}
+
+int timer_pending(struct timer *timer) {
+  int pending;
+
+  pthread_mutex_lock(&mutex);
+  pending = timer->pprev != NULL;
+  pthread_mutex_unlock(&mutex);
+  return pending;
+}
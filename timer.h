@@ -0,0 +1,21 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+
+struct timer {
+  struct timer *next;
+  struct timer **pprev;  // NULL if the timer is not pending
+  uint64_t expires;      // in ticks
+  unsigned int slot;
+  void (*func)(void *arg);
+  void *arg;
+};
+
+int timer_init(void);
+void timer_setup(struct timer *timer, void (*func)(void *), void *arg);
+void timer_add(struct timer *timer, uint64_t usec);
+int timer_del(struct timer *timer);
+int timer_pending(struct timer *timer);
+
+#endif
@@ -86,6 +86,41 @@ int queue_pop(struct queue_head *queue, void **data, size_t *size) {
   return 0;
 }
 
+/*
+ * RING BUFFER OPERATIONS
+ */
+
+// positions are free running counters and wrapped by the mask, so that they
+// can be sequence numbers. len must not exceed the size of the ring
+void ring_write(struct ring *ring, uint32_t pos, const uint8_t *data,
+                size_t len) {
+  size_t off, n;
+
+  off = pos & ring->mask;
+  n = MIN(len, ring->mask + 1 - off);
+  memcpy(ring->buf + off, data, n);
+  memcpy(ring->buf, data + n, len - n);
+}
+
+void ring_read(const struct ring *ring, uint32_t pos, uint8_t *data,
+               size_t len) {
+  size_t off, n;
+
+  off = pos & ring->mask;
+  n = MIN(len, ring->mask + 1 - off);
+  memcpy(data, ring->buf + off, n);
+  memcpy(data + n, ring->buf, len - n);
+}
+
+// returns data at pos in place. len is cut to the part before the wrap
+uint8_t *ring_peek(const struct ring *ring, uint32_t pos, size_t *len) {
+  size_t off;
+
+  off = pos & ring->mask;
+  *len = MIN(*len, ring->mask + 1 - off);
+  return ring->buf + off;
+}
+
 uint16_t cksum16(uint16_t *data, uint16_t size, uint32_t init) {
   uint32_t sum;
 
@@ -26,11 +26,23 @@ struct queue_head {
   unsigned int num;
 };
 
+// circular byte buffer. size is a power of two
+struct ring {
+  uint8_t *buf;
+  uint32_t mask;  // size - 1
+};
+
 void hexdump(FILE *fp, void *data, size_t size);
 
 int queue_push(struct queue_head *queue, void *data, size_t size);
 int queue_pop(struct queue_head *queue, void **data, size_t *size);
 
+void ring_write(struct ring *ring, uint32_t pos, const uint8_t *data,
+                size_t len);
+void ring_read(const struct ring *ring, uint32_t pos, uint8_t *data,
+               size_t len);
+uint8_t *ring_peek(const struct ring *ring, uint32_t pos, size_t *len);
+
 uint16_t cksum16(uint16_t *data, uint16_t size, uint32_t init);
 uint16_t hton16(uint16_t);
 uint16_t ntoh16(uint16_t);